@@ -0,0 +1,136 @@
+#include "attr_cache.h"
+#include "rpc_calls.h"
+#include "debug.h"
+#include "lease.h"
+#include "getattr_multi.h"
+#include <errno.h>
+#include <string.h>
+#include <string>
+using namespace std;
+
+int get_server_attr(void *userdata, const char *path, struct stat *statbuf) {
+    struct files_store *user = (struct files_store *) userdata;
+    time_t current_time = time(0);
+
+    // serve from the cache while the entry is within its time to live, or
+    // for as long as a lease on the path is held
+    auto it = user->attr_cache.find(string(path));
+    if (it != user->attr_cache.end() &&
+        ((current_time - it->second.fetched) < user->attr_ttl || holds_lease(userdata, path))) {
+        DLOG("Attr: Cached attributes of '%s'", path);
+        if (it->second.result == 0) {
+            *statbuf = it->second.attr;
+        }
+        return it->second.result;
+    }
+
+    return fetch_server_attr(userdata, path, statbuf);
+}
+
+int fetch_server_attr(void *userdata, const char *path, struct stat *statbuf) {
+    struct files_store *user = (struct files_store *) userdata;
+    uint64_t revoked = lease_revocations(userdata, path);
+    int returnCode = rpc_getattr(userdata, path, statbuf);
+
+    // the path changed while the rpc was out, the answer may be from before
+    if (lease_revocations(userdata, path) != revoked) {
+        DLOG("Attr: '%s' revoked during getattr, not caching", path);
+        return returnCode;
+    }
+
+    // only a missing path is worth remembering, other errors may be transient
+    if (returnCode < 0 && returnCode != -ENOENT) {
+        DLOG("Attr: Could not retrieve file attr from server");
+        user->attr_cache.erase(string(path));
+        return returnCode;
+    }
+
+    struct attr_entry &entry = user->attr_cache[string(path)];
+    entry.result = returnCode;
+    if (returnCode == 0) {
+        entry.attr = *statbuf;
+    }
+    entry.fetched = time(0);
+    return returnCode;
+}
+
+void store_server_attr(void *userdata, const char *path, const struct stat *statbuf) {
+    struct files_store *user = (struct files_store *) userdata;
+    struct attr_entry &entry = user->attr_cache[string(path)];
+    entry.result = 0;
+    entry.attr = *statbuf;
+    entry.fetched = time(0);
+}
+
+void invalidate_server_attr(void *userdata, const char *path) {
+    struct files_store *user = (struct files_store *) userdata;
+    user->attr_cache.erase(string(path));
+}
+
+// Send one getattr_multi for paths [first, last) and cache the answers.
+static void prefetch_batch(struct files_store *user, const vector<string> &paths,
+                           size_t first, size_t last, const string &packed) {
+    int count = (int) (last - first);
+    vector<struct attr_result> results(count);
+    vector<uint64_t> revoked(count);
+    for (int i = 0; i < count; i++) {
+        revoked[i] = lease_revocations(user, paths[first + i].c_str());
+    }
+    int returnCode = rpc_getattr_multi(user, packed.data(), packed.size(), count, results.data());
+    if (returnCode != count) {
+        DLOG("Attr: getattr_multi failed with %d", returnCode);
+        return;
+    }
+
+    time_t current_time = time(0);
+    for (int i = 0; i < count; i++) {
+        // as in get_server_attr, only a missing path is worth remembering
+        if (results[i].result < 0 && results[i].result != -ENOENT) {
+            continue;
+        }
+        // as in fetch_server_attr, skip paths revoked while the rpc was out
+        if (lease_revocations(user, paths[first + i].c_str()) != revoked[i]) {
+            continue;
+        }
+        struct attr_entry &entry = user->attr_cache[paths[first + i]];
+        entry.result = results[i].result;
+        if (results[i].result == 0) {
+            entry.attr = results[i].attr;
+        }
+        entry.fetched = current_time;
+    }
+}
+
+void prefetch_server_attrs(void *userdata, const vector<string> &paths) {
+    struct files_store *user = (struct files_store *) userdata;
+    time_t current_time = time(0);
+
+    vector<string> wanted;
+    for (const string &path : paths) {
+        auto it = user->attr_cache.find(path);
+        if (it != user->attr_cache.end() && (current_time - it->second.fetched) < user->attr_ttl) {
+            continue;
+        }
+        // a path that doesn't fit in one rpc on its own is left to getattr
+        if (path.size() + 1 > MAX_ARRAY_LEN) {
+            continue;
+        }
+        wanted.push_back(path);
+    }
+
+    // pack paths until either the request or the reply array would overflow
+    string packed;
+    size_t first = 0;
+    for (size_t i = 0; i < wanted.size(); i++) {
+        if (i - first == GETATTR_MULTI_MAX || packed.size() + wanted[i].size() + 1 > MAX_ARRAY_LEN) {
+            prefetch_batch(user, wanted, first, i, packed);
+            packed.clear();
+            first = i;
+        }
+        packed.append(wanted[i]);
+        packed.push_back('\0');
+    }
+    if (first < wanted.size()) {
+        prefetch_batch(user, wanted, first, wanted.size(), packed);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef ATTR_CACHE_H
+#define ATTR_CACHE_H
+
+#include <sys/stat.h>
+#include "global.h"
+
+// The attribute cache keeps the server's stat of each path for attr_ttl
+// seconds, so getattr on files that aren't open costs at most one
+// rpc_getattr per interval and never transfers file contents. Paths the
+// server reported missing are cached too, as negative entries.
+
+// Fill statbuf with the server's attributes of path, from the cache if the
+// entry is younger than attr_ttl, otherwise with rpc_getattr. Returns
+// -ENOENT for a cached negative entry.
+int get_server_attr(void *userdata, const char *path, struct stat *statbuf);
+
+// Like get_server_attr, but always asks the server and refreshes the cache.
+// Used where a stale size or time would be copied into the cached file, such
+// as downloads under the transfer lock and freshness checks.
+int fetch_server_attr(void *userdata, const char *path, struct stat *statbuf);
+
+// Fill the cache for many paths at once with rpc_getattr_multi, as many paths
+// per rpc as fit. Paths with a live entry are skipped. Failures leave the
+// cache as it was, get_server_attr falls back to one rpc per path.
+void prefetch_server_attrs(void *userdata, const vector<string> &paths);
+
+// Cache attributes of path that came back from another rpc, e.g. openfetch.
+void store_server_attr(void *userdata, const char *path, const struct stat *statbuf);
+
+// Drop the cached attributes of path, e.g. after this client changed it.
+void invalidate_server_attr(void *userdata, const char *path);
+
+#endif
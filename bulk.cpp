@@ -0,0 +1,35 @@
+#include "bulk.h"
+#include <errno.h>
+#include <sys/socket.h>
+
+int send_all(int sock, const void *buf, size_t len) {
+    const char *pos = (const char *) buf;
+    while (len > 0) {
+        ssize_t sent = send(sock, pos, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        pos += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+int recv_all(int sock, void *buf, size_t len) {
+    char *pos = (char *) buf;
+    while (len > 0) {
+        ssize_t received = recv(sock, pos, len, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        pos += received;
+        len -= received;
+    }
+    return 0;
+}
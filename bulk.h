@@ -0,0 +1,90 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// The bulk channel is a plain TCP connection, next to the rpc library, that
+// carries file bodies in large frames. Control rpcs (open, getattr, lock, ...)
+// stay on the rpc library.
+
+// Frame operations.
+#define BULK_READ 1
+#define BULK_WRITE 2
+// Turns the connection into a lease notify connection, see lease.h. The
+// reply carries the client id.
+#define BULK_NOTIFY 3
+
+// Largest payload carried by one frame.
+#define BULK_FRAME_SIZE (8 * 1024 * 1024)
+
+// Returned by the client functions when the channel can't be used, so the
+// caller should fall back to the rpc path.
+#define BULK_UNAVAILABLE -1000
+
+// Idle connections the client keeps open for later transfers. More may be
+// open while that many transfers run at once.
+#define BULK_CONNECTIONS 4
+
+// After a connection fails the client uses rpcs for a while before it tries
+// to connect again, doubling the wait up to the maximum on every failure.
+#define BULK_RETRY_MIN_MS 100
+#define BULK_RETRY_MAX_MS 30000
+
+// Sent by the client before every frame. A write request is followed by size
+// bytes of data.
+struct bulk_request {
+    int32_t op;
+    int32_t unused;
+    // server file handle from open and the session it belongs to, see
+    // session_table
+    uint64_t fh;
+    uint64_t session;
+    int64_t offset;
+    uint64_t size;
+};
+
+// Sent by the server in response to a request. A read reply is followed by
+// result bytes of data.
+struct bulk_reply {
+    // bytes transferred or -errno
+    int64_t result;
+};
+
+// Send or receive exactly len bytes. Return 0 on success, -1 if the
+// connection failed.
+int send_all(int sock, const void *buf, size_t len);
+int recv_all(int sock, void *buf, size_t len);
+
+// SERVER FUNCTIONS
+
+class session_table;
+
+// Open the listening socket and start accepting bulk connections. Frames
+// name files by their handle in table.
+int bulk_server_init(session_table *table);
+
+// Port the bulk channel listens on, or -errno if it isn't running.
+int bulk_server_port();
+
+// CLIENT FUNCTIONS
+
+// Ask the server for its bulk port and connect to it. Transfers connect
+// again later if this fails.
+int bulk_client_init();
+
+// Open another connection to the server's bulk port. Returns the socket or
+// -errno.
+int bulk_connect();
+
+bool bulk_available();
+
+// Read or write size bytes at offset of the server file with handle fh of
+// session. Return the number of bytes transferred, -errno, or
+// BULK_UNAVAILABLE.
+int bulk_read(uint64_t session, uint64_t fh, char *buf, size_t size, off_t offset);
+int bulk_write(uint64_t session, uint64_t fh, const char *buf, size_t size, off_t offset);
+
+void bulk_client_destroy();
+
+#endif
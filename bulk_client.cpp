@@ -0,0 +1,234 @@
+#include "bulk.h"
+#include "debug.h"
+#include "rpc_calls.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <vector>
+using namespace std;
+
+// Set by bulk_client_init when the channel is turned on.
+static bool bulk_enabled = false;
+// Open connections no transfer is using. A transfer takes one for itself,
+// so transfers of different files don't wait for each other.
+static vector<int> idle_socks;
+// No new connection is tried before retry_at, retry_ms is the next wait.
+static chrono::steady_clock::time_point retry_at;
+static int retry_ms = BULK_RETRY_MIN_MS;
+// Protects the state above, not held during transfers.
+static mutex bulk_mutex;
+
+int bulk_connect() {
+    int port = rpc_bulkport(nullptr);
+    if (port < 0) {
+        DLOG("BULK: Server has no bulk channel (%d)", port);
+        return port;
+    }
+
+    // the bulk channel lives on the same host as the rpc server
+    const char *host = getenv("SERVER_ADDRESS");
+    if (host == nullptr) {
+        return -EINVAL;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    struct addrinfo *addrs = nullptr;
+    if (getaddrinfo(host, port_str, &hints, &addrs) != 0) {
+        DLOG("BULK: Could not resolve '%s', using rpcs", host);
+        return -EHOSTUNREACH;
+    }
+
+    int sock = -1;
+    for (struct addrinfo *addr = addrs; addr != nullptr; addr = addr->ai_next) {
+        sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+        if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addrs);
+
+    if (sock < 0) {
+        DLOG("BULK: Could not connect to bulk channel");
+        return -ECONNREFUSED;
+    }
+
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    DLOG("BULK: Connected to bulk channel on port %d", port);
+    return sock;
+}
+
+// Stop connecting for a while after a failure. Called with bulk_mutex held.
+static void bulk_backoff() {
+    retry_at = chrono::steady_clock::now() + chrono::milliseconds(retry_ms);
+    DLOG("BULK: Using rpcs for file data for %d ms", retry_ms);
+    retry_ms = min(retry_ms * 2, BULK_RETRY_MAX_MS);
+}
+
+// Take an idle connection, or open a new one. Returns -1 if the channel is
+// off or still backing off from a failure.
+static int bulk_take() {
+    {
+        lock_guard<mutex> guard(bulk_mutex);
+        if (!bulk_enabled) {
+            return -1;
+        }
+        if (!idle_socks.empty()) {
+            int sock = idle_socks.back();
+            idle_socks.pop_back();
+            return sock;
+        }
+        if (chrono::steady_clock::now() < retry_at) {
+            return -1;
+        }
+    }
+
+    // connect without the lock, other transfers can use idle connections
+    int sock = bulk_connect();
+
+    lock_guard<mutex> guard(bulk_mutex);
+    if (sock < 0) {
+        bulk_backoff();
+        return -1;
+    }
+    retry_ms = BULK_RETRY_MIN_MS;
+    return sock;
+}
+
+// Return a connection after a transfer, closing it if enough are idle.
+static void bulk_give(int sock) {
+    lock_guard<mutex> guard(bulk_mutex);
+    if (bulk_enabled && idle_socks.size() < BULK_CONNECTIONS) {
+        idle_socks.push_back(sock);
+        return;
+    }
+    close(sock);
+}
+
+// Drop a broken connection, transfers go through rpcs until the backoff
+// is over.
+static int bulk_fail(int sock) {
+    DLOG("BULK: Connection failed, falling back to rpcs");
+    close(sock);
+
+    lock_guard<mutex> guard(bulk_mutex);
+    bulk_backoff();
+    return BULK_UNAVAILABLE;
+}
+
+int bulk_client_init() {
+    {
+        lock_guard<mutex> guard(bulk_mutex);
+        bulk_enabled = true;
+    }
+
+    int sock = bulk_take();
+    if (sock < 0) {
+        return -ECONNREFUSED;
+    }
+    bulk_give(sock);
+    return 0;
+}
+
+bool bulk_available() {
+    lock_guard<mutex> guard(bulk_mutex);
+    return bulk_enabled && (!idle_socks.empty() || chrono::steady_clock::now() >= retry_at);
+}
+
+int bulk_read(uint64_t session, uint64_t fh, char *buf, size_t size, off_t offset) {
+    int sock = bulk_take();
+    if (sock < 0) {
+        return BULK_UNAVAILABLE;
+    }
+
+    int64_t total = 0;
+    while (size > 0) {
+        struct bulk_request request = {BULK_READ, 0, fh, session, offset, min(size, (size_t) BULK_FRAME_SIZE)};
+        struct bulk_reply reply;
+
+        if (send_all(sock, &request, sizeof(request)) < 0 ||
+            recv_all(sock, &reply, sizeof(reply)) < 0) {
+            return bulk_fail(sock);
+        }
+        if (reply.result < 0) {
+            bulk_give(sock);
+            return reply.result;
+        }
+        if ((uint64_t) reply.result > request.size ||
+            recv_all(sock, buf, reply.result) < 0) {
+            return bulk_fail(sock);
+        }
+
+        total += reply.result;
+        // the file ended early
+        if ((uint64_t) reply.result < request.size) {
+            break;
+        }
+        buf += reply.result;
+        offset += reply.result;
+        size -= reply.result;
+    }
+
+    bulk_give(sock);
+    return total;
+}
+
+int bulk_write(uint64_t session, uint64_t fh, const char *buf, size_t size, off_t offset) {
+    int sock = bulk_take();
+    if (sock < 0) {
+        return BULK_UNAVAILABLE;
+    }
+
+    int64_t total = 0;
+    while (size > 0) {
+        struct bulk_request request = {BULK_WRITE, 0, fh, session, offset, min(size, (size_t) BULK_FRAME_SIZE)};
+        struct bulk_reply reply;
+
+        if (send_all(sock, &request, sizeof(request)) < 0 ||
+            send_all(sock, buf, request.size) < 0 ||
+            recv_all(sock, &reply, sizeof(reply)) < 0) {
+            return bulk_fail(sock);
+        }
+        if (reply.result < 0) {
+            bulk_give(sock);
+            return reply.result;
+        }
+
+        total += reply.result;
+        if ((uint64_t) reply.result < request.size) {
+            break;
+        }
+        buf += reply.result;
+        offset += reply.result;
+        size -= reply.result;
+    }
+
+    bulk_give(sock);
+    return total;
+}
+
+void bulk_client_destroy() {
+    lock_guard<mutex> guard(bulk_mutex);
+    bulk_enabled = false;
+    for (int sock : idle_socks) {
+        close(sock);
+    }
+    idle_socks.clear();
+}
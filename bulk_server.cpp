@@ -0,0 +1,322 @@
+#include "bulk.h"
+#include "lease.h"
+#include "global.h"
+#include "debug.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+using namespace std;
+
+// Seconds a lease notice may wait for a client's socket to drain.
+#define NOTIFY_SEND_TIMEOUT 5
+
+// Sessions whose handles frames name.
+static session_table *sessions = nullptr;
+
+// Listening socket of the bulk channel, -1 if it isn't running.
+static int listen_sock = -1;
+static int listen_port = -ENOTCONN;
+
+// Move size bytes of a write frame from the socket into the file at offset.
+// The data goes socket -> pipe -> file with splice, so it never enters user
+// space. If the file can't be spliced into, the rest of the frame is copied
+// through a buffer instead. The whole payload is always consumed, so the
+// connection stays in sync after a file error. Returns bytes written or
+// -errno, and sets *conn_failed if the connection broke.
+static int64_t splice_frame_to_file(int sock, int fd, off_t offset, size_t size,
+                                    int pipe_fds[2], char *buf, bool *conn_failed) {
+    int64_t written = 0;
+    int file_err = 0;
+    bool use_splice = true;
+
+    while (size > 0) {
+        ssize_t in_pipe = splice(sock, nullptr, pipe_fds[1], nullptr, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in_pipe <= 0) {
+            *conn_failed = true;
+            return -EIO;
+        }
+        size -= in_pipe;
+
+        // drain everything that was moved into the pipe
+        while (in_pipe > 0) {
+            ssize_t out = -1;
+            if (use_splice && file_err == 0) {
+                loff_t file_offset = offset + written;
+                out = splice(pipe_fds[0], nullptr, fd, &file_offset, in_pipe, SPLICE_F_MOVE);
+                if (out < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    DLOG("BULK: splice to file not supported, copying instead");
+                    use_splice = false;
+                    continue;
+                }
+                if (out <= 0) {
+                    file_err = out < 0 ? errno : EIO;
+                    continue;
+                }
+            }
+            else {
+                out = read(pipe_fds[0], buf, min((size_t) in_pipe, (size_t) BULK_FRAME_SIZE));
+                if (out <= 0) {
+                    *conn_failed = true;
+                    return -EIO;
+                }
+                if (file_err == 0 && pwrite(fd, buf, out, offset + written) != out) {
+                    file_err = errno != 0 ? errno : EIO;
+                }
+            }
+
+            in_pipe -= out;
+            if (file_err == 0) {
+                written += out;
+            }
+        }
+    }
+
+    if (file_err != 0) {
+        return -file_err;
+    }
+    return written;
+}
+
+// Send size bytes of the file at offset to the socket. The data moves from
+// the page cache to the socket with sendfile, so it never passes through user
+// space. If sendfile can't be used on this file, splice it through a pipe,
+// and as a last resort copy it through buf. Returns 0 once every byte is sent,
+// or -1 if the file ended early or the connection failed.
+static int send_file_range(int sock, int fd, off_t offset, size_t size,
+                           int pipe_fds[2], char *buf) {
+    bool use_sendfile = true;
+    bool use_splice = true;
+
+    while (size > 0) {
+        if (use_sendfile) {
+            ssize_t sent = sendfile(sock, fd, &offset, size);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                DLOG("BULK: sendfile not supported, trying splice");
+                use_sendfile = false;
+                continue;
+            }
+            if (sent <= 0) {
+                return -1;
+            }
+            size -= sent;
+        }
+        else if (use_splice) {
+            loff_t file_offset = offset;
+            ssize_t in_pipe = splice(fd, &file_offset, pipe_fds[1], nullptr, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in_pipe < 0 && errno == EINTR) {
+                continue;
+            }
+            if (in_pipe < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                DLOG("BULK: splice not supported, copying instead");
+                use_splice = false;
+                continue;
+            }
+            if (in_pipe <= 0) {
+                return -1;
+            }
+
+            // the pipe must be emptied even if the socket fails, so it can
+            // be reused by later frames
+            bool failed = false;
+            ssize_t left = in_pipe;
+            while (left > 0) {
+                ssize_t out = failed ? -1 : splice(pipe_fds[0], nullptr, sock, nullptr, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (out < 0 && errno == EINTR && !failed) {
+                    continue;
+                }
+                if (out <= 0) {
+                    failed = true;
+                    out = read(pipe_fds[0], buf, left);
+                    if (out <= 0) {
+                        return -1;
+                    }
+                }
+                left -= out;
+            }
+            if (failed) {
+                return -1;
+            }
+
+            offset += in_pipe;
+            size -= in_pipe;
+        }
+        else {
+            ssize_t bytes_read = pread(fd, buf, min(size, (size_t) BULK_FRAME_SIZE), offset);
+            if (bytes_read <= 0 || send_all(sock, buf, bytes_read) < 0) {
+                return -1;
+            }
+            offset += bytes_read;
+            size -= bytes_read;
+        }
+    }
+
+    return 0;
+}
+
+// Serve frames from one client until it disconnects.
+static void serve_connection(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        DLOG("BULK: Could not create pipe");
+        close(sock);
+        return;
+    }
+
+    char *buf = (char *) malloc(BULK_FRAME_SIZE);
+
+    struct bulk_request request;
+    while (recv_all(sock, &request, sizeof(request)) == 0) {
+        struct bulk_reply reply;
+
+        if (request.size > BULK_FRAME_SIZE) {
+            DLOG("BULK: Frame too large, dropping connection");
+            break;
+        }
+
+        // the descriptor stays open until the frame is done, even if the
+        // handle is closed meanwhile
+        int fd = -EBADF;
+        if (request.op == BULK_READ || request.op == BULK_WRITE) {
+            fd = sessions->use(request.session, request.fh, request.op == BULK_WRITE);
+        }
+        bool conn_failed = false;
+
+        if (request.op == BULK_READ) {
+            // the reply header carries the length, so work it out up front
+            struct stat statbuf;
+            if (fstat(fd, &statbuf) < 0) {
+                reply.result = -errno;
+            }
+            else if (request.offset >= statbuf.st_size) {
+                reply.result = 0;
+            }
+            else {
+                reply.result = min((int64_t) request.size, (int64_t) (statbuf.st_size - request.offset));
+            }
+
+            if (send_all(sock, &reply, sizeof(reply)) < 0) {
+                conn_failed = true;
+            }
+            else if (reply.result > 0 &&
+                     send_file_range(sock, fd, request.offset, reply.result, pipe_fds, buf) < 0) {
+                // the promised bytes couldn't all be sent, so the stream is
+                // out of sync and the client has to reconnect or use rpcs
+                conn_failed = true;
+            }
+        }
+        else if (request.op == BULK_WRITE) {
+            reply.result = splice_frame_to_file(sock, fd, request.offset, request.size,
+                                                pipe_fds, buf, &conn_failed);
+            if (!conn_failed && send_all(sock, &reply, sizeof(reply)) < 0) {
+                conn_failed = true;
+            }
+        }
+        else if (request.op == BULK_NOTIFY) {
+            // from now on the server only sends lease notices on this
+            // connection; a client that stops reading must not stall them
+            struct timeval timeout = {NOTIFY_SEND_TIMEOUT, 0};
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            int client_id = lease_register_client(sock);
+            reply.result = client_id;
+            if (send_all(sock, &reply, sizeof(reply)) == 0) {
+                // wait for the client to go away
+                char byte;
+                while (recv(sock, &byte, 1, 0) > 0) {
+                }
+            }
+            lease_drop_client(client_id);
+            break;
+        }
+        else {
+            DLOG("BULK: Unknown op %d, dropping connection", request.op);
+            break;
+        }
+
+        if (fd >= 0) {
+            sessions->done(fd);
+        }
+        if (conn_failed) {
+            break;
+        }
+    }
+
+    free(buf);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(sock);
+}
+
+static void accept_connections() {
+    while (true) {
+        int sock = accept(listen_sock, nullptr, nullptr);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            DLOG("BULK: accept failed, stopping bulk channel");
+            listen_port = -errno;
+            return;
+        }
+        thread(serve_connection, sock).detach();
+    }
+}
+
+int bulk_server_init(session_table *table) {
+    sessions = table;
+
+    // a client that disconnects mid-frame must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_sock < 0) {
+        listen_port = -errno;
+        return listen_port;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = 0;
+
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listen_sock, SOMAXCONN) < 0 ||
+        getsockname(listen_sock, (struct sockaddr *) &addr, &addr_len) < 0) {
+        listen_port = -errno;
+        close(listen_sock);
+        listen_sock = -1;
+        return listen_port;
+    }
+
+    listen_port = ntohs(addr.sin_port);
+    DLOG("BULK: Listening on port %d", listen_port);
+
+    thread(accept_connections).detach();
+    return 0;
+}
+
+int bulk_server_port() {
+    return listen_port;
+}
@@ -0,0 +1,286 @@
+#include "cache_index.h"
+#include "utils.h"
+#include "debug.h"
+#include "checksum.h"
+#include "client_lock.h"
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <unistd.h>
+using namespace std;
+
+// Identifies the on-disk format of the index.
+static const char INDEX_MAGIC[8] = {'W', 'D', 'F', 'S', 'I', 'D', 'X', '2'};
+
+// The index lives next to the cache directory rather than inside it, so it
+// can't collide with a file of the same name on the server.
+static string get_index_path(struct files_store *user) {
+    string dir(user->path_to_cache);
+    while (dir.size() > 1 && dir.back() == '/') {
+        dir.pop_back();
+    }
+    return dir + ".watdfs_index";
+}
+
+static bool read_value(FILE *file, void *value, size_t len) {
+    return fread(value, len, 1, file) == 1;
+}
+
+int load_cache_index(struct files_store *user) {
+    string index_path = get_index_path(user);
+    FILE *file = fopen(index_path.c_str(), "rb");
+    if (file == nullptr) {
+        DLOG("Index: No cache index at %s, starting cold", index_path.c_str());
+        return 0;
+    }
+
+    char magic[sizeof(INDEX_MAGIC)];
+    uint64_t num_entries = 0;
+    if (!read_value(file, magic, sizeof(magic)) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+        !read_value(file, &num_entries, sizeof(num_entries))) {
+        DLOG("Index: Unrecognized cache index, starting cold");
+        fclose(file);
+        return -EINVAL;
+    }
+
+    map<string, struct cache_entry> loaded;
+    for (uint64_t i = 0; i < num_entries; i++) {
+        uint32_t path_len = 0;
+        int64_t mtime_sec = 0, mtime_nsec = 0, size = 0;
+        uint64_t last_used = 0, num_checksums = 0;
+        if (!read_value(file, &path_len, sizeof(path_len)) || path_len > PATH_MAX) {
+            break;
+        }
+
+        string path(path_len, '\0');
+        struct cache_entry entry;
+        if (!read_value(file, &path[0], path_len) ||
+            !read_value(file, &mtime_sec, sizeof(mtime_sec)) ||
+            !read_value(file, &mtime_nsec, sizeof(mtime_nsec)) ||
+            !read_value(file, &size, sizeof(size)) ||
+            !read_value(file, &last_used, sizeof(last_used)) ||
+            !read_value(file, &num_checksums, sizeof(num_checksums)) ||
+            size < 0 || num_checksums > (uint64_t) size / BLOCK_SIZE + 1) {
+            break;
+        }
+        entry.checksums.resize(num_checksums);
+        if (num_checksums > 0 &&
+            !read_value(file, entry.checksums.data(), num_checksums * sizeof(uint64_t))) {
+            break;
+        }
+
+        entry.mtime.tv_sec = mtime_sec;
+        entry.mtime.tv_nsec = mtime_nsec;
+        entry.size = size;
+        entry.last_used = last_used;
+        loaded[path] = entry;
+    }
+    fclose(file);
+
+    if (loaded.size() != num_entries) {
+        DLOG("Index: Cache index is truncated, starting cold");
+        return -EINVAL;
+    }
+
+    user->cache_index = loaded;
+    for (auto it = loaded.begin(); it != loaded.end(); it++) {
+        user->cache_clock = max(user->cache_clock, it->second.last_used);
+    }
+    DLOG("Index: Loaded %lu cache entries", (unsigned long) loaded.size());
+    return 0;
+}
+
+int save_cache_index(struct files_store *user) {
+    string index_path = get_index_path(user);
+    string temp_path = index_path + ".tmp";
+
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (file == nullptr) {
+        DLOG("Index: Could not write cache index");
+        return -errno;
+    }
+
+    uint64_t num_entries = user->cache_index.size();
+    bool ok = fwrite(INDEX_MAGIC, sizeof(INDEX_MAGIC), 1, file) == 1 &&
+              fwrite(&num_entries, sizeof(num_entries), 1, file) == 1;
+
+    for (auto it = user->cache_index.begin(); ok && it != user->cache_index.end(); it++) {
+        const struct cache_entry &entry = it->second;
+        uint32_t path_len = it->first.size();
+        int64_t mtime_sec = entry.mtime.tv_sec, mtime_nsec = entry.mtime.tv_nsec, size = entry.size;
+        uint64_t last_used = entry.last_used, num_checksums = entry.checksums.size();
+
+        ok = fwrite(&path_len, sizeof(path_len), 1, file) == 1 &&
+             fwrite(it->first.data(), path_len, 1, file) == 1 &&
+             fwrite(&mtime_sec, sizeof(mtime_sec), 1, file) == 1 &&
+             fwrite(&mtime_nsec, sizeof(mtime_nsec), 1, file) == 1 &&
+             fwrite(&size, sizeof(size), 1, file) == 1 &&
+             fwrite(&last_used, sizeof(last_used), 1, file) == 1 &&
+             fwrite(&num_checksums, sizeof(num_checksums), 1, file) == 1 &&
+             (num_checksums == 0 ||
+              fwrite(entry.checksums.data(), num_checksums * sizeof(uint64_t), 1, file) == 1);
+    }
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+
+    // only replace the previous index once the new one is complete
+    if (!ok || rename(temp_path.c_str(), index_path.c_str()) < 0) {
+        DLOG("Index: Could not write cache index");
+        unlink(temp_path.c_str());
+        return -EIO;
+    }
+
+    DLOG("Index: Saved %lu cache entries", (unsigned long) num_entries);
+    return 0;
+}
+
+void record_cache_entry(struct files_store *user, const char *path,
+                        const struct stat *server_stat, const vector<uint64_t> &checksums) {
+    struct cache_entry &entry = user->cache_index[string(path)];
+    entry.mtime = server_stat->st_mtim;
+    entry.size = server_stat->st_size;
+    entry.checksums = checksums;
+    touch_cache_entry(user, &entry);
+}
+
+struct cache_entry *find_cache_entry(struct files_store *user, const char *path) {
+    auto it = user->cache_index.find(string(path));
+    if (it == user->cache_index.end()) {
+        return nullptr;
+    }
+
+    // Downloads and uploads leave the cached copy with the server's
+    // modification time, so a copy that was changed locally, or that a
+    // previous mount didn't finish writing, no longer matches its entry.
+    char *full_path = get_full_path(path, user);
+    struct stat local;
+    int returnCode = stat(full_path, &local);
+    free(full_path);
+
+    if (returnCode < 0 || local.st_size != it->second.size ||
+        local.st_mtim.tv_sec != it->second.mtime.tv_sec ||
+        local.st_mtim.tv_nsec != it->second.mtime.tv_nsec) {
+        DLOG("Index: Cached copy of '%s' changed, dropping entry", path);
+        user->cache_index.erase(it);
+        return nullptr;
+    }
+
+    return &it->second;
+}
+
+void forget_cache_entry(struct files_store *user, const char *path) {
+    user->cache_index.erase(string(path));
+}
+
+bool is_cache_entry_current(const struct cache_entry *entry, const struct stat *server_stat) {
+    return entry->size == server_stat->st_size &&
+           entry->mtime.tv_sec == server_stat->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == server_stat->st_mtim.tv_nsec;
+}
+
+void touch_cache_entry(struct files_store *user, struct cache_entry *entry) {
+    entry->last_used = ++user->cache_clock;
+}
+
+// Every regular file under dir, as (server path, bytes on disk). path is the
+// server path of dir.
+static void list_cached_files(const string &dir, const string &path,
+                              vector<pair<string, off_t>> &files) {
+    DIR *stream = opendir(dir.c_str());
+    if (stream == nullptr) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != nullptr) {
+        string name(entry->d_name);
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        struct stat local;
+        if (lstat((dir + "/" + name).c_str(), &local) < 0) {
+            continue;
+        }
+        if (S_ISDIR(local.st_mode)) {
+            list_cached_files(dir + "/" + name, path + "/" + name, files);
+        }
+        else if (S_ISREG(local.st_mode)) {
+            // sparse copies only take up the blocks fetched so far
+            files.push_back(make_pair(path + "/" + name, (off_t) local.st_blocks * 512));
+        }
+    }
+    closedir(stream);
+}
+
+void evict_cache_entries(struct files_store *user, const char *keep_path) {
+    if (user->cache_capacity <= 0) {
+        return;
+    }
+
+    // Sized from the cache directory rather than the index, which doesn't
+    // know copies whose entries were dropped while they were open, such as
+    // sparse copies, copies changed locally and copies moved by rename.
+    string dir(user->path_to_cache);
+    while (dir.size() > 1 && dir.back() == '/') {
+        dir.pop_back();
+    }
+    vector<pair<string, off_t>> files;
+    list_cached_files(dir, "", files);
+
+    off_t total = 0;
+    for (auto &file : files) {
+        total += file.second;
+    }
+    if (total <= user->cache_capacity) {
+        return;
+    }
+
+    // candidates in least recently used order, copies without an entry first
+    vector<pair<uint64_t, size_t>> candidates;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (files[i].first == keep_path) {
+            continue;
+        }
+        auto it = user->cache_index.find(files[i].first);
+        candidates.push_back(make_pair(it == user->cache_index.end() ? 0 : it->second.last_used, i));
+    }
+    sort(candidates.begin(), candidates.end());
+
+    for (size_t i = 0; i < candidates.size() && total > user->cache_capacity; i++) {
+        const string &path = files[candidates[i].second].first;
+
+        // another operation may be downloading it with store_mutex let go
+        if (path_in_use(user, path)) {
+            continue;
+        }
+
+        char *full_path = get_full_path(path.c_str(), user);
+
+        // open files are keyed by their path in the cache
+        if (file_already_open(user, full_path)) {
+            free(full_path);
+            continue;
+        }
+
+        int returnCode = unlink(full_path);
+        free(full_path);
+
+        if (returnCode < 0 && errno != ENOENT) {
+            DLOG("Evict: Could not remove cached copy of '%s'", path.c_str());
+            continue;
+        }
+
+        DLOG("Evict: Removed cached copy of '%s'", path.c_str());
+        total -= files[candidates[i].second].second;
+        user->cache_index.erase(path);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef CACHE_INDEX_H
+#define CACHE_INDEX_H
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <vector>
+#include "global.h"
+
+// The cache index records which server version each file in path_to_cache
+// holds. It is stored next to the cache directory, so a remounted client can
+// trust its cached copies instead of downloading everything again.
+
+// Load the index saved by a previous mount. A missing or damaged index just
+// leaves the cache cold.
+int load_cache_index(struct files_store *user);
+
+// Write the index next to the cache, replacing the previous one atomically.
+int save_cache_index(struct files_store *user);
+
+// Record that the copy of path in the cache now matches the server version
+// described by server_stat.
+void record_cache_entry(struct files_store *user, const char *path,
+                        const struct stat *server_stat, const vector<uint64_t> &checksums);
+
+// Return the entry for path if the cached copy is still the one it describes,
+// otherwise drop the entry and return nullptr.
+struct cache_entry *find_cache_entry(struct files_store *user, const char *path);
+
+void forget_cache_entry(struct files_store *user, const char *path);
+
+// Mark the cached copy described by entry as just used.
+void touch_cache_entry(struct files_store *user, struct cache_entry *entry);
+
+// Remove least recently used cached copies until the files in the cache
+// directory fit in cache_capacity. Copies without an index entry go first.
+// Open files and keep_path are never removed.
+void evict_cache_entries(struct files_store *user, const char *keep_path);
+
+// True if entry describes the same version as the server's server_stat.
+bool is_cache_entry_current(const struct cache_entry *entry, const struct stat *server_stat);
+
+#endif
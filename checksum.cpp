@@ -0,0 +1,27 @@
+#include "checksum.h"
+#include <string.h>
+
+// 64-bit multiplicative hash, processed a word at a time so hashing a large
+// file is cheap compared to sending it.
+uint64_t block_checksum(const char *buf, size_t len) {
+    const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t) len;
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(uint64_t));
+        h ^= word;
+        h *= prime;
+        h ^= h >> 31;
+    }
+
+    // hash the remaining tail bytes
+    for (; i < len; i++) {
+        h ^= (unsigned char) buf[i];
+        h *= prime;
+    }
+
+    h ^= h >> 33;
+    return h;
+}
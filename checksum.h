@@ -0,0 +1,19 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rpc.h"
+
+// Size of the blocks that the client and server compare when transferring a
+// file. A block is small enough to be fetched with a single read rpc.
+#define BLOCK_SIZE 32768
+
+// Number of block checksums that fit in one rpc array argument.
+#define CHECKSUMS_PER_CALL (MAX_ARRAY_LEN / sizeof(uint64_t))
+
+// Hash len bytes of buf. Used on both sides of the delta protocol, so the
+// client and server must agree on it.
+uint64_t block_checksum(const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,71 @@
+#include "client_lock.h"
+#include "rpc.h"
+#include <algorithm>
+using namespace std;
+
+// store_mutex as held by the client_op running on this thread, if any.
+static thread_local unique_lock<mutex> *held_store = nullptr;
+
+client_op::client_op(void *userdata, const char *path, const char *other_path)
+    : user((struct files_store *) userdata) {
+    paths.push_back(string(path));
+    if (other_path != nullptr && paths[0] != other_path) {
+        paths.push_back(string(other_path));
+    }
+    // a fixed order, so two renames of the same pair can't deadlock
+    sort(paths.begin(), paths.end());
+
+    for (auto &locked : paths) {
+        struct path_lock *entry;
+        {
+            lock_guard<mutex> guard(user->path_locks_mutex);
+            entry = &user->path_locks[locked];
+            entry->users += 1;
+        }
+        entry->lock.lock();
+    }
+
+    store = unique_lock<mutex>(user->store_mutex);
+    outer = held_store;
+    held_store = &store;
+}
+
+client_op::~client_op() {
+    held_store = outer;
+    if (store.owns_lock()) {
+        store.unlock();
+    }
+
+    for (auto it = paths.rbegin(); it != paths.rend(); it++) {
+        lock_guard<mutex> guard(user->path_locks_mutex);
+        auto entry = user->path_locks.find(*it);
+        entry->second.lock.unlock();
+        entry->second.users -= 1;
+        if (entry->second.users == 0) {
+            user->path_locks.erase(entry);
+        }
+    }
+}
+
+store_released::store_released() {
+    if (held_store != nullptr && held_store->owns_lock()) {
+        held_store->unlock();
+        relock = true;
+    }
+}
+
+store_released::~store_released() {
+    if (relock) {
+        held_store->lock();
+    }
+}
+
+int rpc_call_unlocked(const char *name, int *arg_types, void **args) {
+    store_released released;
+    return rpcCall((char *) name, arg_types, args);
+}
+
+bool path_in_use(struct files_store *user, const string &path) {
+    lock_guard<mutex> guard(user->path_locks_mutex);
+    return user->path_locks.count(path) > 0;
+}
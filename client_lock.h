@@ -0,0 +1,46 @@
+#ifndef CLIENT_LOCK_H
+#define CLIENT_LOCK_H
+
+#include "global.h"
+
+// Client operations on the same path run one at a time, operations on
+// different paths only share store_mutex, and that only while they look at
+// or change the client's state. Every rpc, bulk transfer and wait on the
+// server lets go of store_mutex, so one slow transfer no longer stalls the
+// rest of the mount.
+
+// Held by a client operation for its whole run: the lock of its path (both
+// paths for a rename, taken in order), then store_mutex.
+class client_op {
+    struct files_store *user;
+    vector<string> paths;
+    unique_lock<mutex> store;
+    unique_lock<mutex> *outer;
+
+    public:
+
+    client_op(void *userdata, const char *path, const char *other_path = nullptr);
+
+    ~client_op();
+};
+
+// Lets go of store_mutex until the end of the scope, if the calling thread
+// holds it through a client_op. Does nothing on other threads.
+class store_released {
+    bool relock = false;
+
+    public:
+
+    store_released();
+
+    ~store_released();
+};
+
+// rpcCall with store_mutex let go for the round trip.
+int rpc_call_unlocked(const char *name, int *arg_types, void **args);
+
+// Whether a client operation is working on path, so its cached copy must be
+// left alone. Called with store_mutex held.
+bool path_in_use(struct files_store *user, const string &path);
+
+#endif
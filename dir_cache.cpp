@@ -0,0 +1,139 @@
+#include "dir_cache.h"
+#include "attr_cache.h"
+#include "cache_index.h"
+#include "dir_listing.h"
+#include "getattr_multi.h"
+#include "rpc_calls.h"
+#include "debug.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+using namespace std;
+
+// The directory holding path, "/" for top level entries.
+static string parent_of(const string &path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == string::npos || slash == 0) {
+        return "/";
+    }
+    return path.substr(0, slash);
+}
+
+// path of the entry name in directory dir.
+static string child_of(const string &dir, const string &name) {
+    if (dir == "/") {
+        return dir + name;
+    }
+    return dir + "/" + name;
+}
+
+int get_dir_listing(void *userdata, const char *path, const struct dir_listing **listing) {
+    struct files_store *user = (struct files_store *) userdata;
+    time_t current_time = time(0);
+
+    auto it = user->dir_cache.find(string(path));
+    if (it != user->dir_cache.end() && (current_time - it->second.fetched) < user->attr_ttl) {
+        DLOG("Dir: Cached listing of '%s'", path);
+        *listing = &it->second;
+        return 0;
+    }
+
+    struct dir_listing fetched;
+    fetched.fetched = current_time;
+
+    char *page = (char *) malloc(READDIR_PAGE_SIZE);
+    off_t cookie = 0;
+    while (cookie >= 0) {
+        off_t next = -1;
+        int returnCode = rpc_readdir(userdata, path, cookie, page, READDIR_PAGE_SIZE, &next);
+        if (returnCode < 0) {
+            DLOG("Dir: Could not read listing from server");
+            free(page);
+            user->dir_cache.erase(string(path));
+            return returnCode;
+        }
+
+        size_t used = 0;
+        for (int i = 0; i < returnCode; i++) {
+            struct dir_record record;
+            memcpy(&record, page + used, sizeof(record));
+
+            struct dir_entry entry;
+            entry.name = string(page + used + sizeof(record), record.name_len);
+            entry.ino = record.ino;
+            entry.type = record.type;
+            fetched.entries.push_back(entry);
+
+            used += DIR_RECORD_LEN(record.name_len);
+        }
+
+        cookie = next;
+    }
+    free(page);
+
+    DLOG("Dir: Read %zu entries of '%s'", fetched.entries.size(), path);
+    struct dir_listing &cached = user->dir_cache[string(path)];
+    cached = move(fetched);
+    *listing = &cached;
+    return 0;
+}
+
+void invalidate_parent_listing(void *userdata, const char *path) {
+    struct files_store *user = (struct files_store *) userdata;
+    user->dir_cache.erase(parent_of(string(path)));
+}
+
+// Erase path and every key under path/ from a map keyed by server path.
+template <typename T>
+static void erase_tree(map<string, T> &cache, const string &path) {
+    cache.erase(path);
+    string prefix = path == "/" ? path : path + "/";
+    auto it = cache.lower_bound(prefix);
+    while (it != cache.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        it = cache.erase(it);
+    }
+}
+
+void forget_cached_tree(void *userdata, const char *path) {
+    struct files_store *user = (struct files_store *) userdata;
+    erase_tree(user->attr_cache, string(path));
+    erase_tree(user->dir_cache, string(path));
+    erase_tree(user->cache_index, string(path));
+}
+
+void prefetch_sibling_attrs(void *userdata, const char *path) {
+    struct files_store *user = (struct files_store *) userdata;
+    time_t current_time = time(0);
+
+    auto attr = user->attr_cache.find(string(path));
+    if (attr != user->attr_cache.end() && (current_time - attr->second.fetched) < user->attr_ttl) {
+        return;
+    }
+
+    string dir = parent_of(string(path));
+    auto it = user->dir_cache.find(dir);
+    if (it == user->dir_cache.end() || (current_time - it->second.fetched) >= user->attr_ttl) {
+        return;
+    }
+
+    // find path in the listing, then take it and the entries after it
+    const vector<struct dir_entry> &entries = it->second.entries;
+    string name = string(path).substr(dir == "/" ? 1 : dir.size() + 1);
+    size_t first = 0;
+    while (first < entries.size() && entries[first].name != name) {
+        first++;
+    }
+
+    vector<string> paths;
+    for (size_t i = first; i < entries.size() && paths.size() < GETATTR_MULTI_MAX; i++) {
+        if (entries[i].name == "." || entries[i].name == "..") {
+            continue;
+        }
+        paths.push_back(child_of(dir, entries[i].name));
+    }
+
+    if (!paths.empty()) {
+        prefetch_server_attrs(userdata, paths);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include "global.h"
+
+// The directory cache keeps the server's listing of each directory read
+// through the mount for attr_ttl seconds, like the attribute cache. A listing
+// is read with as few readdir rpcs as READDIR_PAGE_SIZE allows.
+
+// Point listing at the server's listing of path, from the cache if it is
+// younger than attr_ttl, otherwise read page by page with rpc_readdir.
+// Returns 0 or -errno. listing is valid until the cache next changes.
+int get_dir_listing(void *userdata, const char *path, const struct dir_listing **listing);
+
+// Drop the cached listing of the directory that holds path, e.g. after this
+// client created or removed path.
+void invalidate_parent_listing(void *userdata, const char *path);
+
+// Forget everything cached about path and anything under it: attributes,
+// listings and cache index entries. Used when path is removed or renamed.
+void forget_cached_tree(void *userdata, const char *path);
+
+// Before a getattr of path that would miss the attribute cache, stat path and
+// the siblings listed after it with one getattr_multi, so a stat of every
+// entry of a cached listing (ls -l) costs one rpc per batch.
+void prefetch_sibling_attrs(void *userdata, const char *path);
+
+#endif
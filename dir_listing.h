@@ -0,0 +1,30 @@
+#ifndef DIR_LISTING_H
+#define DIR_LISTING_H
+
+#include <stdint.h>
+#include "rpc.h"
+
+// The readdir rpc returns a directory one page at a time. A page is a run of
+// dir_records, each followed by its NUL terminated name and padded so the
+// next record starts 8 byte aligned.
+
+struct dir_record {
+    uint64_t ino;
+    // d_type of the entry
+    uint32_t type;
+    // length of the name, not counting the NUL
+    uint32_t name_len;
+};
+
+// Bytes a record with a name of name_len takes up in a page.
+#define DIR_RECORD_LEN(name_len) ((sizeof(struct dir_record) + (name_len) + 1 + 7) & ~(size_t) 7)
+
+// Most bytes of records returned by one readdir rpc.
+#define READDIR_PAGE_SIZE MAX_ARRAY_LEN
+
+// The server keeps the directory stream of a listing between its pages, at
+// most this many at once, each for at most this many seconds unread.
+#define READDIR_STREAMS 64
+#define READDIR_STREAM_SECONDS 30
+
+#endif
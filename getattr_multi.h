@@ -0,0 +1,22 @@
+#ifndef GETATTR_MULTI_H
+#define GETATTR_MULTI_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "rpc.h"
+
+// The getattr_multi rpc stats many paths in one round trip. Paths are sent
+// packed one after another, each ending in a NUL, and the reply holds one
+// attr_result per path in the same order.
+
+struct attr_result {
+    // 0, or -errno if the path couldn't be stat'ed
+    int32_t result;
+    int32_t unused;
+    struct stat attr;
+};
+
+// Most paths answered by one rpc, bounded by the reply array.
+#define GETATTR_MULTI_MAX (MAX_ARRAY_LEN / sizeof(struct attr_result))
+
+#endif
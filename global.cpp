@@ -2,97 +2,221 @@
 #include "rw_lock.h"
 #include <iostream>
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include "debug.h"
 using namespace std;
 
-// Create a new entry file entry
-void server_mutex::add_file_entry(char *path) {
-    std::cout << "Adding file entry: " << path << std::endl;
-    struct file_mutex new_mutex;
-    new_mutex.lock = new rw_lock_t;
-    rw_lock_init(new_mutex.lock);
-    files[string(path)] = new_mutex;
+static bool is_write_mode(int flags) {
+    return (flags & O_ACCMODE) == O_WRONLY || (flags & O_ACCMODE) == O_RDWR;
 }
 
-// Remove file entry on release and release memory
-void server_mutex::remove_file_entry(char *path) {
-    auto it = files.find(string(path));
-    if (it != files.end()) {
-        delete it->second.lock;
-        files.erase(it);
+server_mutex::server_mutex() {
+    for (auto &s : shards) {
+        rw_lock_init(&s.lock);
     }
 }
 
+struct server_mutex::shard &server_mutex::shard_for(const string &path) {
+    return shards[hash<string>()(path) % OPEN_TABLE_SHARDS];
+}
+
+// Check for conflicting writers and count the open in a single step, so two
+// clients racing to open the same file for writing can't both succeed
+int server_mutex::open_file(char *path, int flags) {
+    string key(path);
+    struct shard &s = shard_for(key);
+
+    rw_lock_lock(&s.lock, RW_WRITE_LOCK);
+
+    auto it = s.files.find(key);
+    if (it == s.files.end()) {
+        // Create a new entry file entry
+        std::cout << "Adding file entry: " << path << std::endl;
+        struct file_mutex new_mutex;
+        it = s.files.emplace(key, new_mutex).first;
+    }
+    else if (is_write_mode(flags) && it->second.num_writers > 0) {
+        // file is open in write mode, so request for write access is denied
+        rw_lock_unlock(&s.lock, RW_WRITE_LOCK);
+        return -EACCES;
+    }
+
+    it->second.mode = flags;
+    it->second.num_times_opened += 1;
+    if (is_write_mode(flags)) {
+        it->second.num_writers += 1;
+    }
+
+    rw_lock_unlock(&s.lock, RW_WRITE_LOCK);
+    return 0;
+}
+
+// Remove file entry on last release and release memory
+void server_mutex::release_file(char *path, int flags) {
+    string key(path);
+    struct shard &s = shard_for(key);
+
+    rw_lock_lock(&s.lock, RW_WRITE_LOCK);
+
+    auto it = s.files.find(key);
+    if (it != s.files.end()) {
+        it->second.num_times_opened -= 1;
+        if (is_write_mode(flags) && it->second.num_writers > 0) {
+            it->second.num_writers -= 1;
+        }
+        std::cout << "Release Called: " << it->second.num_times_opened << std::endl;
+        if (it->second.num_times_opened <= 0) {
+            s.files.erase(it);
+        }
+    }
+
+    rw_lock_unlock(&s.lock, RW_WRITE_LOCK);
+}
+
 // Check to see if file exists in map
 bool server_mutex::is_file_open(char *path) {
-    auto it = files.find(string(path));
-    std::cout << "IS FILE OPEN: " << it->first << std::endl;
+    string key(path);
+    struct shard &s = shard_for(key);
+
+    rw_lock_lock(&s.lock, RW_READ_LOCK);
+    bool found = s.files.find(key) != s.files.end();
+    rw_lock_unlock(&s.lock, RW_READ_LOCK);
+
+    return found;
+}
+
+int server_mutex::get_count(char *path) {
+    string key(path);
+    struct shard &s = shard_for(key);
+
+    int count = 0; // Not found
+    rw_lock_lock(&s.lock, RW_READ_LOCK);
+    auto it = s.files.find(key);
+    if (it != s.files.end()) {
+        count = it->second.num_times_opened;
+    }
+    rw_lock_unlock(&s.lock, RW_READ_LOCK);
 
-    return files.find(string(path)) != files.end();
+    return count;
 }
 
-// Implement the get_mode function
-int server_mutex::get_mode(char *path) {
-    auto it = files.find(std::string(path));
-    if (it != files.end()) {
-        return it->second.mode;
+// Destructor
+server_mutex::~server_mutex() {
+    // Clear each shard
+    for (auto &s : shards) {
+        s.files.clear();
+        rw_lock_destroy(&s.lock);
     }
-    return -1; // Not found
 }
 
-// Implement the update_mode function
-void server_mutex::update_mode(char *path, int mode) {
-    auto it = files.find(std::string(path));
-    if (it != files.end()) {
-        it->second.mode = mode;
+fd_cache::fd_cache(size_t capacity) : capacity(capacity) {}
+
+int fd_cache::acquire(char *path) {
+    lock_guard<mutex> guard(lock);
+
+    auto found = by_path.find(string(path));
+    if (found != by_path.end()) {
+        struct fd_entry &entry = entries[found->second];
+        if (entry.refs == 0) {
+            idle.erase(entry.idle_pos);
+        }
+        entry.refs += 1;
+        return found->second;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -errno;
     }
+
+    struct fd_entry &entry = entries[fd];
+    entry.path = string(path);
+    entry.refs = 1;
+    by_path[entry.path] = fd;
+
+    evict();
+    return fd;
 }
 
-// Implement the get_lock function
-rw_lock_t *server_mutex::get_lock(char *path) {
-    auto it = files.find(std::string(path));
-    if (it != files.end()) {
-        return it->second.lock;
+int fd_cache::hold(int fd) {
+    lock_guard<mutex> guard(lock);
+
+    auto it = entries.find(fd);
+    if (it == entries.end() || it->second.refs == 0) {
+        return -EBADF;
     }
-    return nullptr; // Not found
+    it->second.refs += 1;
+    return fd;
 }
 
-// Implement the is_can_write function
-bool server_mutex::is_can_write(char *path) {
-    auto it = files.find(std::string(path));
-    if (it != files.end()) {
-        // Check if the mode allows write access
-        std::cout << "Flag 1: " << (it->second.mode & O_ACCMODE)<< std::endl;
-        return (it->second.mode & O_ACCMODE) == O_WRONLY || (it->second.mode & O_ACCMODE) == O_RDWR; 
+int fd_cache::release(int fd) {
+    lock_guard<mutex> guard(lock);
+
+    auto it = entries.find(fd);
+    if (it == entries.end() || it->second.refs == 0) {
+        return -EBADF;
     }
-    return false; // Not found
+
+    struct fd_entry &entry = it->second;
+    entry.refs -= 1;
+    if (entry.refs > 0) {
+        return 0;
+    }
+
+    if (!entry.indexed) {
+        entries.erase(it);
+        return close(fd) < 0 ? -errno : 0;
+    }
+
+    // keep it open for the next user of this path
+    idle.push_front(fd);
+    entry.idle_pos = idle.begin();
+    evict();
+    return 0;
 }
 
-void server_mutex::change(char *path, bool dir) {
-    auto it = files.find(std::string(path));
-    if (it != files.end()) {
-        if (dir) {
-            it->second.num_times_opened += 1;
-            return;
+void fd_cache::invalidate(char *path) {
+    lock_guard<mutex> guard(lock);
+
+    // a renamed directory takes every descriptor under it along
+    string prefix = string(path) + "/";
+    vector<int> stale;
+    for (auto &indexed : by_path) {
+        if (indexed.first == path || indexed.first.compare(0, prefix.size(), prefix) == 0) {
+            stale.push_back(indexed.second);
+        }
+    }
+
+    for (int fd : stale) {
+        struct fd_entry &entry = entries[fd];
+        by_path.erase(entry.path);
+        if (entry.refs == 0) {
+            idle.erase(entry.idle_pos);
+            entries.erase(fd);
+            close(fd);
+        }
+        else {
+            entry.indexed = false;
         }
-        it->second.num_times_opened -= 1;
     }
 }
 
-int server_mutex::get_count(char *path) {
-    auto it = files.find(std::string(path));
-    if (it != files.end()) {
-        return it->second.num_times_opened;
+// Close least recently used idle descriptors until the cache is within
+// capacity. Descriptors in use are never closed. Called with lock held.
+void fd_cache::evict() {
+    while (entries.size() > capacity && !idle.empty()) {
+        int fd = idle.back();
+        idle.pop_back();
+
+        by_path.erase(entries[fd].path);
+        entries.erase(fd);
+        close(fd);
     }
-    return 0; // Not found
 }
 
-// Destructor
-server_mutex::~server_mutex() {
-    // Iterate over each entry in the map
-    for (auto& entry : files) {
-        delete entry.second.lock;
+fd_cache::~fd_cache() {
+    for (auto &entry : entries) {
+        close(entry.first);
     }
-    // Clear the map
-    files.clear();
-}
\ No newline at end of file
+}
@@ -1,53 +1,448 @@
+#ifndef GLOBAL_H
+#define GLOBAL_H
+
+#include <atomic>
+#include <list>
+#include <chrono>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include "rw_lock.h"
 using namespace std;
 
 // ------------------------------- GLOBAL DATA ---------------------------------------------
 
+class stream_reader;
+
+// Identifies one version of a file at the server. Any change to the file
+// changes its inode change time, even one that puts the old modification
+// time back.
+struct file_version {
+    struct timespec mtime;
+    struct timespec ctime;
+    off_t size;
+    ino_t ino;
+};
+
 struct file_info {
     int client_fi;
-    int server_fi;
+    // handle of the open at the server
+    uint64_t server_fi;
     int flags;
     time_t tc;
+    // byte ranges written since the last upload, start -> end
+    map<off_t, off_t> dirty;
+    // smallest size the file was truncated to since the last upload, -1 if none
+    off_t truncated_to = -1;
+    // in sparse mode, which blocks of the local copy have been fetched from
+    // the server; empty once the whole copy is present
+    vector<bool> present;
+    off_t num_missing = 0;
+    // set for O_RDONLY opens in streaming mode, which have no local copy
+    shared_ptr<stream_reader> stream;
+    // server version the local copy was last brought up to date with; not
+    // known after an upload until the next freshness check
+    struct file_version version;
+    bool version_known = false;
+};
+
+// What the client knows about a cached copy, kept across remounts in the
+// cache index.
+struct cache_entry {
+    // server modification time and size of the version that is cached
+    struct timespec mtime;
+    off_t size;
+    // checksum of each block of the cached copy, empty if unknown
+    vector<uint64_t> checksums;
+    // value of files_store::cache_clock when the copy was last used
+    uint64_t last_used = 0;
+};
+
+// Server attributes of a path as last seen by the client.
+struct attr_entry {
+    // 0, or -ENOENT if the path did not exist at the server
+    int result;
+    struct stat attr;
+    // when attr was fetched from the server
+    time_t fetched;
+};
+
+// One entry of a cached directory listing.
+struct dir_entry {
+    string name;
+    uint64_t ino;
+    // d_type of the entry
+    unsigned char type;
+};
+
+// A directory listing as last read from the server.
+struct dir_listing {
+    vector<struct dir_entry> entries;
+    // when the listing was read
+    time_t fetched;
+};
+
+// Serializes client operations on one server path, see client_lock.h.
+struct path_lock {
+    mutex lock;
+    // operations holding or waiting for lock, the entry goes with the last
+    int users = 0;
 };
 
 struct files_store {
     map<string, struct file_info> cur_open_files;
     time_t cache_interval;
     const char *path_to_cache;
+    // cached copies by server path, loaded from and saved to the index file
+    map<string, struct cache_entry> cache_index;
+    // bytes the cached copies may take up, 0 for no limit
+    off_t cache_capacity = 0;
+    // ticks once per use of a cached copy, orders entries for eviction
+    uint64_t cache_clock = 0;
+    // server attributes by server path, trusted for attr_ttl seconds
+    map<string, struct attr_entry> attr_cache;
+    time_t attr_ttl;
+    // directory listings by server path, trusted for attr_ttl seconds too
+    map<string, struct dir_listing> dir_cache;
+    // fetch file contents block by block on demand instead of on open
+    bool sparse_files;
+    // serve O_RDONLY opens from the server through a read-ahead ring
+    bool stream_reads;
+    // leave writes in the cache for the flusher thread to push
+    bool write_back;
+    // held by client operations and by the flusher while they look at or
+    // change the data above, but never across an rpc, see client_lock.h
+    mutex store_mutex;
+    // lock of each server path a client operation is working on
+    map<string, struct path_lock> path_locks;
+    mutex path_locks_mutex;
+    // held by the flusher for a whole pass, release and fsync take it first
+    mutex flush_mutex;
+    // the flusher sleeps on flush_cv between passes
+    thread flusher;
+    condition_variable flush_cv;
+    bool flusher_stopping = false;
+    // leases held on server paths, until when they are valid
+    map<string, time_t> leases;
+    // revocations the notifier applied to each server path, see
+    // lease_revocations
+    map<string, uint64_t> revocations;
+    // id the server gave this client for leases, -1 without leases
+    int lease_client_id = -1;
+    // connection the server sends lease notices on, read by notifier
+    int notify_sock = -1;
+    thread notifier;
+    // session at the server, which owns this client's opens and range
+    // locks; 0 while there is none
+    atomic<uint64_t> session_id{0};
+    // seconds a range lock may be waited for before giving up
+    time_t lock_timeout;
+    // sends heartbeats for the session, sleeps on heartbeat_cv
+    thread heartbeat;
+    mutex heartbeat_mutex;
+    condition_variable heartbeat_cv;
+    bool heartbeat_stopping = false;
 };
 
+// Number of independently locked shards in the server's open file table.
+#define OPEN_TABLE_SHARDS 64
+
 struct file_mutex {
     int mode;
     int num_times_opened = 0;
-    rw_lock_t *lock;
+    // number of the opens above that asked for write access
+    int num_writers = 0;
 };
 
+// Table of files open at the server, shared by every rpc thread. Entries are
+// spread over shards by path hash, each with its own lock, so operations on
+// different files rarely contend.
 class server_mutex {
-    map<string, struct file_mutex> files;
+    struct shard {
+        // protects files, held in read mode for lookups
+        rw_lock_t lock;
+        unordered_map<string, struct file_mutex> files;
+    };
+
+    struct shard shards[OPEN_TABLE_SHARDS];
+
+    struct shard &shard_for(const string &path);
 
     public:
 
-    void add_file_entry(char * path);
+    server_mutex();
+
+    // Record an open of path with flags. Returns -EACCES if write access is
+    // asked for while another open of path already has it.
+    int open_file(char *path, int flags);
 
-    void remove_file_entry(char * path);
+    // Undo one open_file of path with flags. The entry is removed with the
+    // last release.
+    void release_file(char *path, int flags);
 
     bool is_file_open(char *path);
 
-    int get_mode(char *path);
+    int get_count(char *path);
 
-    void update_mode(char *path, int mode);
+    ~server_mutex();
+};
 
-    rw_lock_t *get_lock(char *path);
+// Length that locks a range from its offset to the end of the file, however
+// far the file grows.
+#define RANGE_EOF 0
 
-    bool is_can_write(char *path);
+// Byte range locks on server files, shared by every rpc thread. Ranges are
+// held in read or write mode. Overlapping write ranges exclude each other and
+// any readers, ranges that don't overlap never wait on each other. Requests
+// that can't be granted at once are queued per file and granted in arrival
+// order as ranges are released, so a reader also waits for an overlapping
+// writer that asked first and writers aren't starved. The exception is an
+// owner that already holds a range of the file, which only waits for held
+// ranges so its later ranges can't queue behind a request waiting on its
+// earlier ones. Files are spread over
+// shards by path hash like the open file table, and an entry exists only
+// while some range is held or queued for, whether or not the file is open.
+//
+// A queued request is identified by a ticket, which its owner polls until
+// the range is granted; no rpc thread has to wait for it. Every range is
+// leased to its owner for lease seconds, and so is a queued request between
+// polls. Owners renew all their ranges at once, and anything whose lease ran
+// out is dropped the next time the file's entry is looked at, so a client
+// that dies holding or queueing for a lock blocks others for at most one
+// lease.
+class range_lock_table {
+    struct range {
+        off_t end;
+        rw_lock_mode_t mode;
+        // client holding the range, 0 for openfetch which sends none
+        uint64_t owner;
+        // the range is dropped after this unless the owner renews it
+        chrono::steady_clock::time_point expires;
+    };
 
-    void change(char *path, bool dir);
+    // A range asked for under a ticket, while it is queued and from when it
+    // is granted until the ticket is polled.
+    struct request {
+        off_t start;
+        struct range range;
+    };
 
-    int get_count(char *path);
+    struct file_ranges {
+        // held ranges by start offset
+        multimap<off_t, struct range> held;
+        // requests waiting to be granted by ticket, so in arrival order
+        map<uint64_t, struct request> waiting;
+        // requests granted whose ticket wasn't polled yet; range.expires is
+        // when the ticket is forgotten
+        map<uint64_t, struct request> granted;
+    };
 
-    ~server_mutex();
+    struct shard {
+        mutex lock;
+        // notified whenever a queued request in the shard is granted
+        condition_variable granted;
+        unordered_map<string, struct file_ranges> files;
+        // path of every outstanding ticket of the shard
+        unordered_map<uint64_t, string> tickets;
+        uint64_t last_ticket = 0;
+    };
+
+    struct shard shards[OPEN_TABLE_SHARDS];
+    chrono::seconds lease;
+
+    struct shard &shard_for(const string &path);
+
+    // Queue a request for [start, wanted.end) of path and return its ticket.
+    // Tickets carry their shard in the low bits.
+    uint64_t enqueue(struct shard &s, const string &path, struct file_ranges &file,
+                     off_t start, struct range wanted);
+
+    // Drop the ranges, requests and tickets of file that ran out, then grant
+    // what the queue allows. Returns when the next of them runs out.
+    chrono::steady_clock::time_point settle(struct shard &s, struct file_ranges &file);
+
+    // Remove the entry of path if nothing is held or queued for it.
+    void forget_if_idle(struct shard &s, const string &path);
+
+    public:
+
+    range_lock_table(int lease_seconds);
+
+    // Lock [offset, offset + len) of path in mode for owner, waiting at most
+    // timeout_ms for overlapping ranges to be released. A len of RANGE_EOF
+    // locks to the end of the file. Returns 0, -EAGAIN if timeout_ms is 0 and
+    // the range is taken, -ETIMEDOUT if the wait ran out, or -EINVAL for a
+    // bad range.
+    int lock(char *path, off_t offset, off_t len, rw_lock_mode_t mode,
+             uint64_t owner, int timeout_ms);
+
+    // Ask for the same lock without waiting. Returns 0 if it was granted, or
+    // -EINPROGRESS with the request queued under *ticket.
+    int request(char *path, off_t offset, off_t len, rw_lock_mode_t mode,
+                uint64_t owner, uint64_t *ticket);
+
+    // Returns 0 once the request of ticket is granted, after which the ticket
+    // is gone, -EINPROGRESS while it is queued, or -ENOENT for an unknown
+    // ticket, e.g. one that wasn't polled within its lease.
+    int poll(uint64_t ticket);
+
+    // Withdraw the request of ticket, releasing its range if it was granted
+    // in the meantime.
+    int cancel(uint64_t ticket);
+
+    // Release a range owner took with the same arguments. Returns -EPERM if
+    // no such range is held, e.g. because its lease ran out.
+    int unlock(char *path, off_t offset, off_t len, rw_lock_mode_t mode, uint64_t owner);
+
+    // Extend the lease of every range held or queued for by owner. Returns
+    // how many.
+    int renew(uint64_t owner);
+
+    // Release every range held or queued for by owner, e.g. when its session
+    // ended.
+    void drop_owner(uint64_t owner);
+};
+
+// Default number of server file descriptors kept open by fd_cache.
+#define FD_CACHE_SIZE 128
+
+// Server file descriptors shared by path. Every open of a path, from any
+// client or transfer, reuses one descriptor, so hot files are opened once.
+// Descriptors nobody holds stay open in LRU order until the cache is over
+// capacity.
+class fd_cache {
+    struct fd_entry {
+        string path;
+        int refs = 0;
+        // false once the path was removed or replaced, the descriptor is
+        // closed with its last release
+        bool indexed = true;
+        list<int>::iterator idle_pos;
+    };
+
+    mutex lock;
+    size_t capacity;
+    // descriptor -> entry
+    unordered_map<int, struct fd_entry> entries;
+    // path -> its current descriptor
+    unordered_map<string, int> by_path;
+    // descriptors nobody holds, most recently used first
+    list<int> idle;
+
+    void evict();
+
+    public:
+
+    fd_cache(size_t capacity);
+
+    // Return a descriptor for path opened O_RDWR, or -errno.
+    int acquire(char *path);
+
+    // Take another reference to fd, which the caller already holds one on.
+    // Returns fd, or -EBADF if nobody holds it.
+    int hold(int fd);
+
+    // Give back a descriptor returned by acquire or hold.
+    int release(int fd);
+
+    // Stop handing out the descriptor for path, and for any path under it,
+    // e.g. when it is unlinked or renamed.
+    void invalidate(char *path);
+
+    ~fd_cache();
+};
+
+// Clients at the server. A client opens a session at init and keeps it alive
+// with heartbeats. Everything it opens is recorded under its session as an
+// opaque handle, which is what the client gets as fi->fh instead of a server
+// descriptor. A session that misses its heartbeats for timeout seconds is
+// ended by the reaper thread: its handles are closed, its opens are removed
+// from the open file table and its range locks are released, so clients that
+// crash leave nothing behind.
+class session_table {
+    struct handle {
+        uint64_t session;
+        string path;
+        int fd;
+        int flags;
+    };
+
+    struct session {
+        chrono::steady_clock::time_point expires;
+        unordered_set<uint64_t> handles;
+    };
+
+    // protects everything below
+    mutex lock;
+    unordered_map<uint64_t, struct session> sessions;
+    unordered_map<uint64_t, struct handle> handles;
+    // source of session ids and handles
+    int urandom;
+    chrono::seconds timeout;
+
+    server_mutex *open_files;
+    fd_cache *fds;
+    range_lock_table *ranges;
+
+    thread reaper;
+    condition_variable reaper_cv;
+    bool reaper_stopping = false;
+
+    void reap_loop();
+
+    // A fresh 64-bit id straight from the kernel's random source, so ids
+    // can't be predicted from ones seen before.
+    uint64_t random_id();
+
+    // Undo what a handle took. Called without the lock held.
+    void close_handles(const vector<struct handle> &closed);
+
+    public:
+
+    session_table(int timeout_seconds, server_mutex *open_files, fd_cache *fds,
+                  range_lock_table *ranges);
+
+    // Start a session and return its id, which is never 0.
+    uint64_t open();
+
+    // Keep session alive for another timeout, along with its range locks.
+    // Returns -ESTALE if it already ended.
+    int heartbeat(uint64_t session);
+
+    // End session and close everything it still has open.
+    int close(uint64_t session);
+
+    // Open path with flags for session, refusing a second writer. Returns 0
+    // with the new handle in *handle, or -errno. Handles are random, like
+    // session ids, so they can't be guessed from one another.
+    int open_handle(uint64_t session, char *path, int flags, uint64_t *handle);
+
+    // Close a handle session got from open_handle. Returns -EBADF for an
+    // unknown handle or one of another session.
+    int close_handle(uint64_t session, uint64_t handle);
+
+    // Descriptor of session's handle for one operation, or -EBADF. Also
+    // -EBADF for a handle of another session, or for a write through a handle
+    // that was opened read-only. It stays open until given back with done,
+    // even if the session ends meanwhile.
+    int use(uint64_t session, uint64_t handle, bool write);
+
+    void done(int fd);
+
+    ~session_table();
 };
 
 // -----------------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// A lease lets a client trust its cached copy and attributes of a path
+// without asking the server again. Clients open a notify connection on the
+// bulk channel (BULK_NOTIFY) and get a client id back. When a path changes at
+// the server, every client holding a lease on it is sent a lease_notice on
+// that connection and the lease is gone.
+
+// Default number of seconds a lease lasts, 0 turns leases off.
+#define LEASE_SECONDS 30
+
+// Sent by the server on a notify connection, followed by path_len bytes of
+// the path that changed.
+struct lease_notice {
+    uint32_t path_len;
+};
+
+// SERVER FUNCTIONS
+
+void lease_server_init(int seconds);
+
+// Record sock as the notify connection of a new client. Returns its id.
+int lease_register_client(int sock);
+
+// Forget a client whose notify connection closed.
+void lease_drop_client(int client_id);
+
+// Grant client_id a lease on path if the file at full_path still has the
+// modification time and size the client has seen. Returns the length of the
+// lease in seconds, 0 if it wasn't granted, or -errno.
+int lease_grant(int client_id, const char *path, const char *full_path,
+                const struct timespec *mtime, off_t size);
+
+// Called after path changed. Notifies and drops every lease on it and, for
+// a renamed or removed directory, on every path under it.
+void lease_revoke(const char *path);
+
+// CLIENT FUNCTIONS
+
+// Open the notify connection and start listening for notices.
+int lease_client_init(void *userdata);
+
+// Ask for a lease on path, whose server attributes are server_stat.
+void acquire_lease(void *userdata, const char *path, const struct stat *server_stat);
+
+// True while the client holds an unexpired lease on path.
+bool holds_lease(void *userdata, const char *path);
+
+// Number of revocations of path received so far. An rpc about path lets go
+// of store_mutex, so a revocation can arrive before its answer does. Read
+// this before the rpc and only cache the answer if it is unchanged after.
+uint64_t lease_revocations(void *userdata, const char *path);
+
+void lease_client_destroy(void *userdata);
+
+#endif
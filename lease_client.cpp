@@ -0,0 +1,117 @@
+#include "lease.h"
+#include "bulk.h"
+#include "global.h"
+#include "rpc_calls.h"
+#include "debug.h"
+#include <errno.h>
+#include <string>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+using namespace std;
+
+// Apply notices from the server until the notify connection closes.
+static void receive_notices(struct files_store *user) {
+    struct lease_notice notice;
+    string path;
+
+    while (recv_all(user->notify_sock, &notice, sizeof(notice)) == 0) {
+        path.resize(notice.path_len);
+        if (notice.path_len > 0 && recv_all(user->notify_sock, &path[0], notice.path_len) < 0) {
+            break;
+        }
+
+        DLOG("LEASE: Lease on '%s' revoked", path.c_str());
+        lock_guard<mutex> guard(user->store_mutex);
+        user->leases.erase(path);
+        user->attr_cache.erase(path);
+        user->revocations[path] += 1;
+    }
+
+    // without the connection revocations would be missed, so stop trusting
+    // leases and go back to polling
+    DLOG("LEASE: Notify connection closed, dropping all leases");
+    lock_guard<mutex> guard(user->store_mutex);
+    user->leases.clear();
+    user->lease_client_id = -1;
+}
+
+int lease_client_init(void *userdata) {
+    struct files_store *user = (struct files_store *) userdata;
+
+    int sock = bulk_connect();
+    if (sock < 0) {
+        DLOG("LEASE: No notify connection, polling for changes");
+        return sock;
+    }
+
+    struct bulk_request request = {BULK_NOTIFY, 0, 0, 0, 0, 0};
+    struct bulk_reply reply;
+    if (send_all(sock, &request, sizeof(request)) < 0 ||
+        recv_all(sock, &reply, sizeof(reply)) < 0 || reply.result <= 0) {
+        DLOG("LEASE: Server refused notify connection, polling for changes");
+        close(sock);
+        return -ECONNREFUSED;
+    }
+
+    user->notify_sock = sock;
+    user->lease_client_id = reply.result;
+    user->notifier = thread(receive_notices, user);
+    DLOG("LEASE: Registered as client %d", user->lease_client_id);
+    return 0;
+}
+
+void acquire_lease(void *userdata, const char *path, const struct stat *server_stat) {
+    struct files_store *user = (struct files_store *) userdata;
+    if (user->lease_client_id < 0) {
+        return;
+    }
+
+    // the lease starts at the server while the rpc is on its way, so count
+    // from before it
+    time_t asked = time(0);
+    uint64_t revoked = lease_revocations(userdata, path);
+    int seconds = rpc_lease(userdata, path, user->lease_client_id, &server_stat->st_mtim,
+                            server_stat->st_size);
+
+    // a revocation that overtook the grant, or a lost notify connection,
+    // means the lease can't be trusted
+    if (seconds > 0 && user->lease_client_id >= 0 &&
+        lease_revocations(userdata, path) == revoked) {
+        // give up a second early so the server never revokes silently
+        user->leases[string(path)] = asked + seconds - 1;
+    }
+}
+
+bool holds_lease(void *userdata, const char *path) {
+    struct files_store *user = (struct files_store *) userdata;
+    auto it = user->leases.find(string(path));
+    if (it == user->leases.end()) {
+        return false;
+    }
+
+    if (it->second <= time(0)) {
+        user->leases.erase(it);
+        return false;
+    }
+    return true;
+}
+
+uint64_t lease_revocations(void *userdata, const char *path) {
+    struct files_store *user = (struct files_store *) userdata;
+    auto it = user->revocations.find(string(path));
+    return it == user->revocations.end() ? 0 : it->second;
+}
+
+void lease_client_destroy(void *userdata) {
+    struct files_store *user = (struct files_store *) userdata;
+    if (user->notify_sock < 0) {
+        return;
+    }
+
+    // wakes receive_notices, which then drops the leases
+    shutdown(user->notify_sock, SHUT_RDWR);
+    user->notifier.join();
+    close(user->notify_sock);
+    user->notify_sock = -1;
+}
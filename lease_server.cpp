@@ -0,0 +1,150 @@
+#include "lease.h"
+#include "bulk.h"
+#include "debug.h"
+#include <errno.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+// A client's notify connection. Notices are sent without lease_mutex held,
+// send_mutex keeps two of them from interleaving on the connection.
+struct notify_client {
+    int sock;
+    shared_ptr<mutex> send_mutex;
+};
+
+static int lease_seconds = LEASE_SECONDS;
+
+// Protects everything below. Granting holds it across the stat of the file,
+// so a change is either seen by the grant or revokes what it granted.
+static mutex lease_mutex;
+static int next_client_id = 1;
+// client id -> its notify connection
+static map<int, struct notify_client> clients;
+// path -> client id -> when the lease expires
+static map<string, map<int, time_t>> leases;
+
+void lease_server_init(int seconds) {
+    lease_seconds = seconds;
+}
+
+int lease_register_client(int sock) {
+    lock_guard<mutex> guard(lease_mutex);
+    int client_id = next_client_id++;
+    clients[client_id] = {sock, make_shared<mutex>()};
+    DLOG("LEASE: Client %d registered", client_id);
+    return client_id;
+}
+
+// Called with lease_mutex held.
+static void forget_client(int client_id) {
+    clients.erase(client_id);
+    for (auto it = leases.begin(); it != leases.end();) {
+        it->second.erase(client_id);
+        if (it->second.empty()) {
+            it = leases.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+}
+
+void lease_drop_client(int client_id) {
+    lock_guard<mutex> guard(lease_mutex);
+    DLOG("LEASE: Client %d disconnected", client_id);
+    forget_client(client_id);
+}
+
+int lease_grant(int client_id, const char *path, const char *full_path,
+                const struct timespec *mtime, off_t size) {
+    lock_guard<mutex> guard(lease_mutex);
+    if (lease_seconds <= 0 || clients.count(client_id) == 0) {
+        return 0;
+    }
+
+    struct stat statbuf;
+    if (stat(full_path, &statbuf) < 0) {
+        return -errno;
+    }
+
+    // the client's view is already out of date
+    if (statbuf.st_size != size || statbuf.st_mtim.tv_sec != mtime->tv_sec ||
+        statbuf.st_mtim.tv_nsec != mtime->tv_nsec) {
+        return 0;
+    }
+
+    leases[string(path)][client_id] = time(0) + lease_seconds;
+    return lease_seconds;
+}
+
+// A lease to revoke: the holder, its connection and the leased path.
+struct revoked_lease {
+    int client_id;
+    struct notify_client client;
+    string path;
+};
+
+void lease_revoke(const char *path) {
+    // A client that stops reading can hold a send up for NOTIFY_SEND_TIMEOUT,
+    // so only the holders are picked under lease_mutex. Each connection is
+    // dup'ed, so it stays open even if its client disconnects meanwhile.
+    vector<struct revoked_lease> targets;
+    {
+        lock_guard<mutex> guard(lease_mutex);
+        time_t now = time(0);
+        auto take = [&](map<string, map<int, time_t>>::iterator it) {
+            for (auto holder = it->second.begin(); holder != it->second.end(); holder++) {
+                auto client = clients.find(holder->first);
+                if (holder->second <= now || client == clients.end()) {
+                    continue;
+                }
+                int sock = dup(client->second.sock);
+                if (sock >= 0) {
+                    targets.push_back({holder->first, notify_client{sock, client->second.send_mutex}, it->first});
+                }
+            }
+            return leases.erase(it);
+        };
+
+        auto it = leases.find(string(path));
+        if (it != leases.end()) {
+            take(it);
+        }
+
+        // a renamed or removed directory takes every path under it along,
+        // and those sort together from path + "/"
+        string prefix = string(path) + "/";
+        it = leases.lower_bound(prefix);
+        while (it != leases.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+            it = take(it);
+        }
+    }
+
+    for (auto &target : targets) {
+        DLOG("LEASE: Revoking lease of client %d on '%s'", target.client_id, target.path.c_str());
+        struct lease_notice notice;
+        notice.path_len = target.path.size();
+        bool failed;
+        {
+            lock_guard<mutex> sending(*target.client.send_mutex);
+            failed = send_all(target.client.sock, &notice, sizeof(notice)) < 0 ||
+                     send_all(target.client.sock, target.path.data(), notice.path_len) < 0;
+        }
+        if (failed) {
+            // the client stops trusting its leases once the connection is
+            // gone, wake its connection thread so it is cleaned up
+            shutdown(target.client.sock, SHUT_RDWR);
+            lock_guard<mutex> guard(lease_mutex);
+            forget_client(target.client_id);
+        }
+        close(target.client.sock);
+    }
+}
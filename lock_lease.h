@@ -0,0 +1,27 @@
+#ifndef LOCK_LEASE_H
+#define LOCK_LEASE_H
+
+#include "global.h"
+
+// Range locks are leased to the session of the client that took them, whose
+// heartbeats renew them (see session.h). The server drops a range whose
+// owner hasn't renewed it within the lease. A contended range is queued at
+// the server and the client polls its ticket, so no rpc thread waits for it.
+
+// Default number of seconds a range lock lasts without renewal.
+#define LOCK_LEASE_SECONDS 30
+
+// Longest range_lock_table::lock waits for a range on the calling thread.
+// Openfetch only tries, with a timeout of 0.
+#define LOCK_WAIT_MAX_MS 5000
+
+// First and longest pause between polls of a queued range, in milliseconds.
+// The pause doubles with every poll.
+#define LOCK_POLL_MIN_MS 1
+#define LOCK_POLL_MAX_MS 100
+
+// Default number of seconds a client keeps polling for a contended range
+// before the transfer fails with -ETIMEDOUT.
+#define LOCK_TIMEOUT 60
+
+#endif
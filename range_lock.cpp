@@ -0,0 +1,398 @@
+#include "global.h"
+#include "lock_lease.h"
+#include "debug.h"
+#include <errno.h>
+#include <limits>
+using namespace std;
+
+// End offset of a range of len bytes at offset, -1 if the range is invalid.
+static off_t range_end(off_t offset, off_t len) {
+    if (offset < 0 || len < 0) {
+        return -1;
+    }
+    if (len == RANGE_EOF || len > numeric_limits<off_t>::max() - offset) {
+        return numeric_limits<off_t>::max();
+    }
+    return offset + len;
+}
+
+// True if a range in ranges overlaps [start, end). Only ranges starting
+// before end can overlap, so the scan stops there.
+template <typename T>
+static bool overlaps(const T &ranges, off_t start, off_t end, bool writes_only) {
+    for (auto it = ranges.begin(); it != ranges.lower_bound(end); it++) {
+        if (it->second.end > start && (!writes_only || it->second.mode == RW_WRITE_LOCK)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// True if owner holds any range in held. Owner 0 is shared by every caller
+// of lock, so it never counts.
+template <typename T>
+static bool holds_any(const T &held, uint64_t owner) {
+    if (owner == 0) {
+        return false;
+    }
+    for (auto it = held.begin(); it != held.end(); it++) {
+        if (it->second.owner == owner) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// True if [start, end) in mode can't be held alongside a range overlapping it
+// in other_mode.
+static bool conflicts(off_t start, off_t end, rw_lock_mode_t mode,
+                      off_t other_start, off_t other_end, rw_lock_mode_t other_mode) {
+    return start < other_end && other_start < end &&
+           (mode == RW_WRITE_LOCK || other_mode == RW_WRITE_LOCK);
+}
+
+// Drop the held ranges whose lease ran out. Returns the earliest time one of
+// the remaining leases runs out, or never if none are held.
+template <typename T>
+static chrono::steady_clock::time_point reap_expired(T &held, chrono::steady_clock::time_point now) {
+    auto next = chrono::steady_clock::time_point::max();
+    for (auto it = held.begin(); it != held.end();) {
+        if (it->second.expires <= now) {
+            DLOG("Range lock: lease of owner %llu ran out", (unsigned long long) it->second.owner);
+            it = held.erase(it);
+        }
+        else {
+            next = min(next, it->second.expires);
+            it++;
+        }
+    }
+    return next;
+}
+
+range_lock_table::range_lock_table(int lease_seconds) : lease(lease_seconds) {}
+
+struct range_lock_table::shard &range_lock_table::shard_for(const string &path) {
+    return shards[hash<string>()(path) % OPEN_TABLE_SHARDS];
+}
+
+uint64_t range_lock_table::enqueue(struct shard &s, const string &path, struct file_ranges &file,
+                                   off_t start, struct range wanted) {
+    s.last_ticket += 1;
+    uint64_t ticket = s.last_ticket * OPEN_TABLE_SHARDS + (uint64_t) (&s - shards);
+
+    struct request queued = {start, wanted};
+    file.waiting.emplace(ticket, queued);
+    s.tickets[ticket] = path;
+    return ticket;
+}
+
+chrono::steady_clock::time_point range_lock_table::settle(struct shard &s, struct file_ranges &file) {
+    auto now = chrono::steady_clock::now();
+    auto next = reap_expired(file.held, now);
+
+    for (auto *requests : {&file.waiting, &file.granted}) {
+        for (auto it = requests->begin(); it != requests->end();) {
+            if (it->second.range.expires <= now) {
+                DLOG("Range lock: ticket %llu wasn't polled in time", (unsigned long long) it->first);
+                s.tickets.erase(it->first);
+                it = requests->erase(it);
+            }
+            else {
+                it++;
+            }
+        }
+    }
+
+    // Grant in arrival order, each request waits for earlier ones it
+    // conflicts with. An owner that already holds a range of the file only
+    // waits for held ranges: the earlier request may be waiting for the range
+    // it holds, and it takes its ranges in ascending order, so it can't wait
+    // on anyone waiting for it.
+    bool granted = false;
+    for (auto it = file.waiting.begin(); it != file.waiting.end();) {
+        off_t start = it->second.start;
+        struct range &wanted = it->second.range;
+
+        bool taken = overlaps(file.held, start, wanted.end, wanted.mode == RW_READ_LOCK);
+        bool queues = !holds_any(file.held, wanted.owner);
+        for (auto earlier = file.waiting.begin(); !taken && queues && earlier != it; earlier++) {
+            taken = conflicts(start, wanted.end, wanted.mode,
+                              earlier->second.start, earlier->second.range.end, earlier->second.range.mode);
+        }
+        if (taken) {
+            next = min(next, wanted.expires);
+            it++;
+            continue;
+        }
+
+        struct range held = wanted;
+        held.expires = now + lease;
+        file.held.emplace(start, held);
+        next = min(next, held.expires);
+
+        // keep the ticket until it is polled, for no longer than a lease
+        struct request done = it->second;
+        done.range.expires = now + lease;
+        file.granted.emplace(it->first, done);
+        it = file.waiting.erase(it);
+        granted = true;
+    }
+
+    for (auto &done : file.granted) {
+        next = min(next, done.second.range.expires);
+    }
+
+    if (granted) {
+        s.granted.notify_all();
+    }
+    return next;
+}
+
+void range_lock_table::forget_if_idle(struct shard &s, const string &path) {
+    auto file = s.files.find(path);
+    if (file != s.files.end() && file->second.held.empty() &&
+        file->second.waiting.empty() && file->second.granted.empty()) {
+        s.files.erase(file);
+    }
+}
+
+int range_lock_table::lock(char *path, off_t offset, off_t len, rw_lock_mode_t mode,
+                           uint64_t owner, int timeout_ms) {
+    off_t end = range_end(offset, len);
+    if (end < 0) {
+        return -EINVAL;
+    }
+    if (timeout_ms < 0 || timeout_ms > LOCK_WAIT_MAX_MS) {
+        timeout_ms = LOCK_WAIT_MAX_MS;
+    }
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+
+    string key(path);
+    struct shard &s = shard_for(key);
+    unique_lock<mutex> guard(s.lock);
+    struct file_ranges &file = s.files[key];
+
+    // this thread withdraws the request itself, so it never runs out
+    struct range wanted = {end, mode, owner, chrono::steady_clock::time_point::max()};
+    uint64_t ticket = enqueue(s, key, file, offset, wanted);
+
+    int ret = 0;
+    for (;;) {
+        auto next_expiry = settle(s, file);
+        if (file.granted.erase(ticket) > 0) {
+            break;
+        }
+        if (timeout_ms == 0) {
+            ret = -EAGAIN;
+            break;
+        }
+        if (chrono::steady_clock::now() >= deadline) {
+            ret = -ETIMEDOUT;
+            break;
+        }
+
+        // wake up for a grant, the deadline, or the next lease to run out
+        s.granted.wait_until(guard, min(deadline, next_expiry));
+    }
+    s.tickets.erase(ticket);
+
+    if (ret < 0) {
+        // requests may have queued behind the one that gave up
+        file.waiting.erase(ticket);
+        settle(s, file);
+        forget_if_idle(s, key);
+        DLOG("Range lock: %s [%ld, %ld) mode %d not granted: %d", path, (long) offset, (long) end, mode, ret);
+        return ret;
+    }
+
+    DLOG("Range lock: %s [%ld, %ld) mode %d", path, (long) offset, (long) end, mode);
+    return 0;
+}
+
+int range_lock_table::request(char *path, off_t offset, off_t len, rw_lock_mode_t mode,
+                              uint64_t owner, uint64_t *ticket) {
+    off_t end = range_end(offset, len);
+    if (end < 0) {
+        return -EINVAL;
+    }
+
+    string key(path);
+    struct shard &s = shard_for(key);
+    lock_guard<mutex> guard(s.lock);
+    struct file_ranges &file = s.files[key];
+
+    struct range wanted = {end, mode, owner, chrono::steady_clock::now() + lease};
+    *ticket = enqueue(s, key, file, offset, wanted);
+    settle(s, file);
+
+    if (file.granted.erase(*ticket) > 0) {
+        s.tickets.erase(*ticket);
+        DLOG("Range lock: %s [%ld, %ld) mode %d", path, (long) offset, (long) end, mode);
+        return 0;
+    }
+
+    DLOG("Range lock: %s [%ld, %ld) mode %d queued as ticket %llu",
+         path, (long) offset, (long) end, mode, (unsigned long long) *ticket);
+    return -EINPROGRESS;
+}
+
+int range_lock_table::poll(uint64_t ticket) {
+    struct shard &s = shards[ticket % OPEN_TABLE_SHARDS];
+    lock_guard<mutex> guard(s.lock);
+
+    auto path = s.tickets.find(ticket);
+    if (path == s.tickets.end()) {
+        return -ENOENT;
+    }
+    string key = path->second;
+    struct file_ranges &file = s.files[key];
+    settle(s, file);
+
+    int ret = -ENOENT;
+    auto queued = file.waiting.find(ticket);
+    if (file.granted.erase(ticket) > 0) {
+        s.tickets.erase(ticket);
+        ret = 0;
+    }
+    else if (queued != file.waiting.end()) {
+        // polling keeps the request alive
+        queued->second.range.expires = chrono::steady_clock::now() + lease;
+        ret = -EINPROGRESS;
+    }
+
+    forget_if_idle(s, key);
+    return ret;
+}
+
+int range_lock_table::cancel(uint64_t ticket) {
+    struct shard &s = shards[ticket % OPEN_TABLE_SHARDS];
+    lock_guard<mutex> guard(s.lock);
+
+    auto path = s.tickets.find(ticket);
+    if (path == s.tickets.end()) {
+        return -ENOENT;
+    }
+    string key = path->second;
+    s.tickets.erase(path);
+    struct file_ranges &file = s.files[key];
+
+    auto done = file.granted.find(ticket);
+    if (done != file.granted.end()) {
+        // granted before the owner gave up, release the range again
+        auto held = file.held.equal_range(done->second.start);
+        for (auto it = held.first; it != held.second; it++) {
+            if (it->second.end == done->second.range.end && it->second.mode == done->second.range.mode &&
+                it->second.owner == done->second.range.owner) {
+                file.held.erase(it);
+                break;
+            }
+        }
+        file.granted.erase(done);
+    }
+    file.waiting.erase(ticket);
+
+    settle(s, file);
+    forget_if_idle(s, key);
+    return 0;
+}
+
+int range_lock_table::unlock(char *path, off_t offset, off_t len, rw_lock_mode_t mode,
+                             uint64_t owner) {
+    off_t end = range_end(offset, len);
+    if (end < 0) {
+        return -EINVAL;
+    }
+
+    string key(path);
+    struct shard &s = shard_for(key);
+    lock_guard<mutex> guard(s.lock);
+
+    auto file = s.files.find(key);
+    if (file == s.files.end()) {
+        return -EPERM;
+    }
+
+    auto held = file->second.held.equal_range(offset);
+    auto it = held.first;
+    while (it != held.second &&
+           (it->second.end != end || it->second.mode != mode || it->second.owner != owner)) {
+        it++;
+    }
+    if (it == held.second) {
+        // You don't actually hold a lock.
+        return -EPERM;
+    }
+    file->second.held.erase(it);
+
+    // hand the range on to whoever queued for it
+    settle(s, file->second);
+    forget_if_idle(s, key);
+    return 0;
+}
+
+int range_lock_table::renew(uint64_t owner) {
+    int renewed = 0;
+    auto expires = chrono::steady_clock::now() + lease;
+
+    for (auto &s : shards) {
+        lock_guard<mutex> guard(s.lock);
+        for (auto &file : s.files) {
+            for (auto &held : file.second.held) {
+                if (held.second.owner == owner) {
+                    held.second.expires = expires;
+                    renewed += 1;
+                }
+            }
+            for (auto &queued : file.second.waiting) {
+                if (queued.second.range.owner == owner &&
+                    queued.second.range.expires != chrono::steady_clock::time_point::max()) {
+                    queued.second.range.expires = expires;
+                    renewed += 1;
+                }
+            }
+        }
+    }
+
+    return renewed;
+}
+
+void range_lock_table::drop_owner(uint64_t owner) {
+    for (auto &s : shards) {
+        lock_guard<mutex> guard(s.lock);
+
+        vector<string> idle;
+        for (auto &file : s.files) {
+            bool dropped = false;
+            for (auto it = file.second.held.begin(); it != file.second.held.end();) {
+                if (it->second.owner == owner) {
+                    it = file.second.held.erase(it);
+                    dropped = true;
+                }
+                else {
+                    it++;
+                }
+            }
+            for (auto *requests : {&file.second.waiting, &file.second.granted}) {
+                for (auto it = requests->begin(); it != requests->end();) {
+                    if (it->second.range.owner == owner) {
+                        s.tickets.erase(it->first);
+                        it = requests->erase(it);
+                        dropped = true;
+                    }
+                    else {
+                        it++;
+                    }
+                }
+            }
+
+            if (dropped) {
+                settle(s, file.second);
+                idle.push_back(file.first);
+            }
+        }
+
+        for (auto &path : idle) {
+            forget_if_idle(s, path);
+        }
+    }
+}
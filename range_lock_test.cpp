@@ -0,0 +1,114 @@
+//
+// Checks of the order in which range_lock_table grants queued requests.
+//
+// make range_lock_test && ./range_lock_test
+//
+// Each case locks ranges of one file for a few owners through request, the
+// way the lockrange rpc does, and checks which requests are granted at once
+// and which are queued. Prints every failed check and exits with 1 if any.
+//
+
+#include "global.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+INIT_LOG
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+            failures += 1;                                                   \
+        }                                                                    \
+    } while (0)
+
+static char path[] = "/file";
+
+// An upload write locks its ranges in ascending order. A reader that queues
+// between its first and second range waits for the first, so the second
+// must not queue behind the reader.
+static void holder_skips_queue() {
+    range_lock_table table(30);
+    uint64_t ticket = 0;
+
+    CHECK(table.request(path, 0, 10, RW_WRITE_LOCK, 1, &ticket) == 0);
+    uint64_t reader = 0;
+    CHECK(table.request(path, 0, RANGE_EOF, RW_READ_LOCK, 2, &reader) == -EINPROGRESS);
+    CHECK(table.request(path, 100, RANGE_EOF, RW_WRITE_LOCK, 1, &ticket) == 0);
+
+    // the reader gets its turn once the upload is done
+    CHECK(table.poll(reader) == -EINPROGRESS);
+    CHECK(table.unlock(path, 0, 10, RW_WRITE_LOCK, 1) == 0);
+    CHECK(table.poll(reader) == -EINPROGRESS);
+    CHECK(table.unlock(path, 100, RANGE_EOF, RW_WRITE_LOCK, 1) == 0);
+    CHECK(table.poll(reader) == 0);
+    CHECK(table.unlock(path, 0, RANGE_EOF, RW_READ_LOCK, 2) == 0);
+}
+
+// The same with two writers uploading overlapping ranges.
+static void two_writers() {
+    range_lock_table table(30);
+    uint64_t ticket = 0;
+
+    CHECK(table.request(path, 0, 10, RW_WRITE_LOCK, 1, &ticket) == 0);
+    uint64_t writer = 0;
+    CHECK(table.request(path, 0, 10, RW_WRITE_LOCK, 2, &writer) == -EINPROGRESS);
+    CHECK(table.request(path, 100, RANGE_EOF, RW_WRITE_LOCK, 1, &ticket) == 0);
+
+    CHECK(table.unlock(path, 0, 10, RW_WRITE_LOCK, 1) == 0);
+    CHECK(table.unlock(path, 100, RANGE_EOF, RW_WRITE_LOCK, 1) == 0);
+    CHECK(table.poll(writer) == 0);
+    CHECK(table.unlock(path, 0, 10, RW_WRITE_LOCK, 2) == 0);
+}
+
+// Owners that hold nothing of the file still queue behind earlier requests,
+// so writers aren't starved by later readers.
+static void others_keep_order() {
+    range_lock_table table(30);
+    uint64_t ticket = 0;
+
+    CHECK(table.request(path, 0, 10, RW_READ_LOCK, 1, &ticket) == 0);
+    uint64_t writer = 0;
+    CHECK(table.request(path, 0, RANGE_EOF, RW_WRITE_LOCK, 2, &writer) == -EINPROGRESS);
+    uint64_t reader = 0;
+    CHECK(table.request(path, 100, 10, RW_READ_LOCK, 3, &reader) == -EINPROGRESS);
+
+    CHECK(table.unlock(path, 0, 10, RW_READ_LOCK, 1) == 0);
+    CHECK(table.poll(writer) == 0);
+    CHECK(table.poll(reader) == -EINPROGRESS);
+    CHECK(table.unlock(path, 0, RANGE_EOF, RW_WRITE_LOCK, 2) == 0);
+    CHECK(table.poll(reader) == 0);
+}
+
+// Owner 0 is shared by every caller of lock, so holding a range as owner 0
+// lets nobody skip the queue.
+static void shared_owner_queues() {
+    range_lock_table table(30);
+
+    CHECK(table.lock(path, 0, 10, RW_READ_LOCK, 0, 0) == 0);
+    uint64_t writer = 0;
+    CHECK(table.request(path, 0, RANGE_EOF, RW_WRITE_LOCK, 2, &writer) == -EINPROGRESS);
+    CHECK(table.lock(path, 100, 10, RW_READ_LOCK, 0, 0) == -EAGAIN);
+
+    CHECK(table.unlock(path, 0, 10, RW_READ_LOCK, 0) == 0);
+    CHECK(table.poll(writer) == 0);
+    CHECK(table.unlock(path, 0, RANGE_EOF, RW_WRITE_LOCK, 2) == 0);
+}
+
+int main() {
+    holder_skips_queue();
+    two_writers();
+    others_keep_order();
+    shared_owner_queues();
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -1,6 +1,13 @@
 #include "rpc_calls.h"
 #include "debug.h"
 #include "rpc.h"
+#include "checksum.h"
+#include "rpc_pool.h"
+#include "bulk.h"
+#include "global.h"
+#include "client_lock.h"
+#include <algorithm>
+#include <vector>
 using namespace std;
 
 // GET FILE ATTRIBUTES
@@ -51,7 +58,7 @@ int rpc_getattr(void *userdata, const char *path, struct stat *statbuf) {
     arg_types[3] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"getattr", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("getattr", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value rpc_getattr will return.
@@ -122,7 +129,7 @@ int rpc_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
     arg_types[4] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"mknod", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("mknod", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
@@ -147,8 +154,12 @@ int rpc_open(void *userdata, const char *path,
 
     // SET UP THE RPC CALL
     DLOG("rpc_open called for '%s'", path);
+
+    // the open is recorded under this client's session
+    struct files_store *user = (struct files_store *) userdata;
+    uint64_t session = user->session_id;
     
-    int ARG_COUNT = 3;
+    int ARG_COUNT = 4;
 
     void **args = new void*[ARG_COUNT];
 
@@ -165,14 +176,17 @@ int rpc_open(void *userdata, const char *path,
     arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct fuse_file_info);
     args[1] = (void *) fi;
 
-    arg_types[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    arg_types[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[2] = (void *) &session;
+
+    arg_types[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
     int returnCode = 0;
-    args[2] = (void *) &returnCode;
+    args[3] = (void *) &returnCode;
 
-    arg_types[3] = 0;
+    arg_types[4] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"open", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("open", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
@@ -193,8 +207,12 @@ int rpc_open(void *userdata, const char *path,
 int rpc_release(void *userdata, const char *path,
                        struct fuse_file_info *fi) {
     // Called during close, but possibly asynchronously.
+
+    // the handle only closes for the session it was opened in
+    struct files_store *user = (struct files_store *) userdata;
+    uint64_t session = user->session_id;
     
-    int ARG_COUNT = 3;
+    int ARG_COUNT = 4;
 
     void **args = new void*[ARG_COUNT];
 
@@ -210,14 +228,17 @@ int rpc_release(void *userdata, const char *path,
     arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct fuse_file_info);    
     args[1] = (void *) fi;
 
-    arg_types[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    arg_types[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[2] = (void *) &session;
+
+    arg_types[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
     int returnCode = 0;
-    args[2] = (void *) &returnCode;
+    args[3] = (void *) &returnCode;
 
-    arg_types[3] = 0;
+    arg_types[4] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"release", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("release", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
@@ -235,73 +256,31 @@ int rpc_release(void *userdata, const char *path,
 }
 
 // READ AND WRITE DATA
-int rpc_read(void *userdata, const char *path, char *buf, size_t size,
-                    off_t offset, struct fuse_file_info *fi) {
-    // Read size amount of data at offset of file into buf.
-
-    // Remember that size may be greater than the maximum array size of the RPC
-    // library.
-
-    int returnCode = 0;
-    int fxn_ret = 0;
-    int count  = 0;
-    off_t new_offset = offset;
-    size_t packSize = MAX_ARRAY_LEN;
-
-    while (size > packSize) {
-
-        int ARG_COUNT  = 6;
-
-        void **args = new void*[ARG_COUNT];
 
-        int arg_types[ARG_COUNT + 1];
+// Pool used to keep several chunks of a transfer in flight, nullptr when
+// chunks are sent one at a time.
+static rpc_pool *chunk_pool = nullptr;
 
-        // The path has string length (strlen) + 1 (for the null character).
-        int pathlen = strlen(path) + 1;
-
-        arg_types[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
-        args[0] = (void *) path;
-
-        arg_types[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) MAX_ARRAY_LEN;
-        args[1] = (void *) buf;
-
-        arg_types[2] =  (1u << ARG_INPUT) | (ARG_LONG << 16u);
-        args[2] = (void *) &packSize;
-
-        arg_types[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
-        args[3] = (void *) &new_offset;
-
-        arg_types[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct fuse_file_info);
-        args[4] = (void *) fi;
-
-        arg_types[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
-        args[5] = (void *) &returnCode;
-
-        arg_types[6] = 0;
-
-        int rpc_ret = rpcCall((char *)"read", arg_types, args);
+int rpc_pool_init(int window) {
+    if (window > 1 && chunk_pool == nullptr) {
+        chunk_pool = new rpc_pool(window);
+    }
+    return 0;
+}
 
-        if (rpc_ret < 0) {
-            fxn_ret = -EINVAL;
-            delete []args;
-            return fxn_ret;
-        }
-        else if (returnCode < 0) {
-            fxn_ret = returnCode;
-            delete []args;
-            return fxn_ret;
-        }
+void rpc_pool_destroy() {
+    delete chunk_pool;
+    chunk_pool = nullptr;
+}
 
-        new_offset += returnCode;
-        buf += returnCode;
-        size -= returnCode;  
-        count += 1;
+int rpc_read_chunk(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi, uint64_t session) {
+    // Read at most MAX_ARRAY_LEN bytes at offset of file into buf, with a
+    // single rpc.
 
-        delete []args;
-    }
+    int returnCode = 0;
 
-    int ARG_COUNT  = 6;
+    int ARG_COUNT  = 7;
 
     void **args = new void*[ARG_COUNT];
 
@@ -321,26 +300,28 @@ int rpc_read(void *userdata, const char *path, char *buf, size_t size,
     args[2] = (void *) &size;
 
     arg_types[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
-    args[3] = (void *) &new_offset;
+    args[3] = (void *) &offset;
 
     arg_types[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct fuse_file_info);
     args[4] = (void *) fi;
 
-    arg_types[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
-    args[5] = (void *) &returnCode;
+    arg_types[5] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[5] = (void *) &session;
+
+    arg_types[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    args[6] = (void *) &returnCode;
 
-    arg_types[6] = 0;
+    arg_types[7] = 0;
 
-    int rpc_ret = rpcCall((char *)"read", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("read", arg_types, args);
 
+    int fxn_ret = 0;
     if (rpc_ret < 0) {
+        DLOG("read rpc failed with error '%d'", rpc_ret);
         fxn_ret = -EINVAL;
     }
-    else if (returnCode < 0) {
-        fxn_ret = returnCode;
-    } 
     else {
-        fxn_ret = (count * packSize) + returnCode;
+        fxn_ret = returnCode;
     }
 
     delete []args;
@@ -348,72 +329,14 @@ int rpc_read(void *userdata, const char *path, char *buf, size_t size,
     return fxn_ret;
 }
 
+int rpc_write_chunk(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi, uint64_t session) {
+    // Write at most MAX_ARRAY_LEN bytes at offset of file from buf, with a
+    // single rpc.
 
-int rpc_write(void *userdata, const char *path, const char *buf,
-                     size_t size, off_t offset, struct fuse_file_info *fi) {
-    // Write size amount of data at offset of file from buf.
-
-    // Remember that size may be greater than the maximum array size of the RPC
     int returnCode = 0;
-    int fxn_ret = 0;
-    int count  = 0;
-    off_t new_offset = offset;
-    size_t packSize = MAX_ARRAY_LEN;
-
-    while (size > packSize) {
-
-        int ARG_COUNT  = 6;
-
-        void **args = new void*[ARG_COUNT];
-
-        int arg_types[ARG_COUNT + 1];
-
-        // The path has string length (strlen) + 1 (for the null character).
-        int pathlen = strlen(path) + 1;
-
-        arg_types[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
-        args[0] = (void *) path;
-
-        arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) packSize;
-        args[1] = (void *) buf;
 
-        arg_types[2] =  (1u << ARG_INPUT) | (ARG_LONG << 16u);
-        args[2] = (void *) &packSize;
-
-        arg_types[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
-        args[3] = (void *) &new_offset;
-
-        arg_types[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct fuse_file_info);
-        args[4] = (void *) fi;
-
-        arg_types[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
-        args[5] = (void *) &returnCode;
-
-        arg_types[6] = 0;
-
-        int rpc_ret = rpcCall((char *)"write", arg_types, args);
-
-        if (rpc_ret < 0) {
-            fxn_ret = -EINVAL;
-            delete []args;
-            return fxn_ret;
-        }
-        else if (returnCode < 0) {
-            fxn_ret = returnCode;
-            delete []args;
-            return fxn_ret;
-        }
-
-        new_offset += returnCode;
-        buf += returnCode;
-        size -= returnCode;  
-        count += 1;
-
-        delete []args;
-    }
-
-    int ARG_COUNT  = 6;
+    int ARG_COUNT  = 7;
 
     void **args = new void*[ARG_COUNT];
 
@@ -433,31 +356,121 @@ int rpc_write(void *userdata, const char *path, const char *buf,
     args[2] = (void *) &size;
 
     arg_types[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
-    args[3] = (void *) &new_offset;
+    args[3] = (void *) &offset;
 
     arg_types[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct fuse_file_info);
     args[4] = (void *) fi;
 
-    arg_types[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
-    args[5] = (void *) &returnCode;
+    arg_types[5] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[5] = (void *) &session;
 
-    arg_types[6] = 0;
+    arg_types[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    args[6] = (void *) &returnCode;
 
-    int rpc_ret = rpcCall((char *)"write", arg_types, args);
+    arg_types[7] = 0;
 
+    int rpc_ret = rpc_call_unlocked("write", arg_types, args);
+
+    int fxn_ret = 0;
     if (rpc_ret < 0) {
+        DLOG("write rpc failed with error '%d'", rpc_ret);
         fxn_ret = -EINVAL;
     }
-    else if (returnCode < 0) {
-        fxn_ret = returnCode;
-    } 
     else {
-        fxn_ret = (count * packSize) + returnCode;
+        fxn_ret = returnCode;
     }
 
     delete []args;
 
-    return fxn_ret;           
+    return fxn_ret;
+}
+
+// Split a transfer into MAX_ARRAY_LEN chunks and run them, through the pool
+// when there is more than one chunk. Returns the number of bytes transferred
+// up to the first short chunk, or the first error.
+int rpc_transfer(bool is_write, const char *path, char *buf, size_t size,
+                 off_t offset, struct fuse_file_info *fi, uint64_t session) {
+    vector<struct rpc_chunk> chunks;
+    size_t done = 0;
+    do {
+        size_t chunk_size = min(size - done, (size_t) MAX_ARRAY_LEN);
+        chunks.push_back({is_write, path, buf + done, chunk_size, offset + (off_t) done, fi, session, 0, nullptr, nullptr});
+        done += chunk_size;
+    } while (done < size);
+
+    if (chunk_pool != nullptr && chunks.size() > 1) {
+        chunk_pool->run(chunks);
+    }
+    else {
+        for (auto &chunk : chunks) {
+            if (is_write) {
+                chunk.result = rpc_write_chunk(path, chunk.buf, chunk.size, chunk.offset, fi, session);
+            }
+            else {
+                chunk.result = rpc_read_chunk(path, chunk.buf, chunk.size, chunk.offset, fi, session);
+            }
+            if (chunk.result < 0 || (size_t) chunk.result < chunk.size) {
+                break;
+            }
+        }
+    }
+
+    // reassemble the results in offset order
+    int fxn_ret = 0;
+    for (auto &chunk : chunks) {
+        if (chunk.result < 0) {
+            return chunk.result;
+        }
+        fxn_ret += chunk.result;
+        if ((size_t) chunk.result < chunk.size) {
+            break;
+        }
+    }
+
+    return fxn_ret;
+}
+
+int rpc_read(void *userdata, const char *path, char *buf, size_t size,
+                    off_t offset, struct fuse_file_info *fi) {
+    // Read size amount of data at offset of file into buf.
+
+    // other client operations may go on while the data moves
+    store_released released;
+
+    // the handle is only valid for the session it was opened in
+    uint64_t session = ((struct files_store *) userdata)->session_id;
+
+    // File bodies go over the bulk channel when the server offers one.
+    int bulk_ret = bulk_read(session, fi->fh, buf, size, offset);
+    if (bulk_ret != BULK_UNAVAILABLE) {
+        return bulk_ret;
+    }
+
+    // Remember that size may be greater than the maximum array size of the RPC
+    // library.
+    return rpc_transfer(false, path, buf, size, offset, fi, session);
+}
+
+
+int rpc_write(void *userdata, const char *path, const char *buf,
+                     size_t size, off_t offset, struct fuse_file_info *fi) {
+    // Write size amount of data at offset of file from buf.
+
+    // other client operations may go on while the data moves
+    store_released released;
+
+    // the handle is only valid for the session it was opened in
+    uint64_t session = ((struct files_store *) userdata)->session_id;
+
+    // File bodies go over the bulk channel when the server offers one.
+    int bulk_ret = bulk_write(session, fi->fh, buf, size, offset);
+    if (bulk_ret != BULK_UNAVAILABLE) {
+        return bulk_ret;
+    }
+
+    // Remember that size may be greater than the maximum array size of the RPC
+    // library.
+    return rpc_transfer(true, path, (char *) buf, size, offset, fi, session);
 }
 
 
@@ -486,7 +499,7 @@ int rpc_truncate(void *userdata, const char *path, off_t newsize) {
 
     arg_types[3] = 0;
 
-    int rpc_ret = rpcCall((char *)"truncate", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("truncate", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
@@ -506,8 +519,12 @@ int rpc_truncate(void *userdata, const char *path, off_t newsize) {
 int rpc_fsync(void *userdata, const char *path,
                      struct fuse_file_info *fi) {
     // Force a flush of file data.
+
+    // the handle is only valid for the session it was opened in
+    struct files_store *user = (struct files_store *) userdata;
+    uint64_t session = user->session_id;
     
-    int ARG_COUNT = 3;
+    int ARG_COUNT = 4;
 
     void **args = new void*[ARG_COUNT];
 
@@ -523,13 +540,16 @@ int rpc_fsync(void *userdata, const char *path,
     arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) |(uint) sizeof(struct fuse_file_info);
     args[1] = (void *) fi;
 
-    arg_types[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    arg_types[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[2] = (void *) &session;
+
+    arg_types[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
     int returnCode = 0;
-    args[2] = (void *) &returnCode;
+    args[3] = (void *) &returnCode;
 
-    arg_types[3] = 0;
+    arg_types[4] = 0;
 
-    int rpc_ret = rpcCall((char *)"fsync", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("fsync", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
@@ -576,7 +596,7 @@ int rpc_utimensat(void *userdata, const char *path,
     arg_types[3] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"ultimensat", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("ultimensat", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
@@ -589,3 +609,572 @@ int rpc_utimensat(void *userdata, const char *path,
 
     return fxn_ret;
 }
+
+// DELTA TRANSFER
+int rpc_checksums(void *userdata, const char *path, uint64_t *hashes,
+                       size_t count, off_t first_block) {
+    // Fetch the checksums of count blocks of the server's copy of the file,
+    // starting at block first_block. Returns the number of checksums filled in.
+
+    DLOG("rpc_checksums called for '%s' (block %ld)", path, (long) first_block);
+
+    if (count > CHECKSUMS_PER_CALL) {
+        count = CHECKSUMS_PER_CALL;
+    }
+
+    int ARG_COUNT = 5;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *) path;
+
+    arg_types[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) (count * sizeof(uint64_t));
+    args[1] = (void *) hashes;
+
+    arg_types[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[2] = (void *) &count;
+
+    arg_types[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[3] = (void *) &first_block;
+
+    arg_types[4] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[4] = (void *) &returnCode;
+
+    arg_types[5] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("checksums", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("checksums rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+int rpc_bulkport(void *userdata) {
+    // Ask the server which port its bulk data channel listens on. Returns the
+    // port or -errno.
+
+    DLOG("rpc_bulkport called");
+
+    int ARG_COUNT = 1;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    arg_types[0] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[0] = (void *) &returnCode;
+
+    arg_types[1] = 0;
+
+    int rpc_ret = rpc_call_unlocked("bulkport", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("bulkport rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -ENOTSUP;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+int rpc_lease(void *userdata, const char *path, int client_id,
+                       const struct timespec *mtime, off_t size) {
+    // Ask for a lease on path for the version with modification time mtime
+    // and size. Returns the length of the lease in seconds, 0 if it wasn't
+    // granted, or -errno.
+
+    DLOG("rpc_lease called for '%s'", path);
+
+    int ARG_COUNT = 5;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *) path;
+
+    arg_types[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+    args[1] = (void *) &client_id;
+
+    arg_types[2] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct timespec);
+    args[2] = (void *) mtime;
+
+    arg_types[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[3] = (void *) &size;
+
+    arg_types[4] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[4] = (void *) &returnCode;
+
+    arg_types[5] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("lease", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("lease rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+int rpc_getattr_multi(void *userdata, const char *paths, size_t paths_len,
+                       int count, struct attr_result *results) {
+    // Stat count paths, packed NUL terminated in paths, in one rpc. Fills one
+    // entry of results per path and returns the number filled, or -errno.
+
+    DLOG("rpc_getattr_multi called for %d paths", count);
+
+    int ARG_COUNT = 4;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) paths_len;
+    args[0] = (void *) paths;
+
+    arg_types[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+    args[1] = (void *) &count;
+
+    arg_types[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) (count * sizeof(struct attr_result));
+    args[2] = (void *) results;
+
+    arg_types[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[3] = (void *) &returnCode;
+
+    arg_types[4] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("getattr_multi", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("getattr_multi rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+int rpc_openfetch(void *userdata, const char *path, struct fuse_file_info *fi,
+                  struct stat *statbuf, char *buf, size_t size) {
+    // Open path at the server with fi->flags and read its first size bytes,
+    // in one rpc. The server holds the file's read lock throughout, so
+    // statbuf describes the data in buf. Fills in fi->fh and returns the
+    // number of bytes read, or -errno with nothing left open.
+
+    DLOG("rpc_openfetch called for '%s'", path);
+
+    struct files_store *user = (struct files_store *) userdata;
+    uint64_t session = user->session_id;
+
+    int ARG_COUNT = 7;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    // Fill in the arguments
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *) path;
+
+    arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct fuse_file_info);
+    args[1] = (void *) fi;
+
+    arg_types[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) sizeof(struct stat);
+    args[2] = (void *) statbuf;
+
+    arg_types[3] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) size;
+    args[3] = (void *) buf;
+
+    arg_types[4] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[4] = (void *) &size;
+
+    arg_types[5] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[5] = (void *) &session;
+
+    arg_types[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[6] = (void *) &returnCode;
+
+    arg_types[7] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("openfetch", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("openfetch rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        DLOG("Return Code for openfetch: %d", returnCode);
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+int rpc_mkdir(void *userdata, const char *path, mode_t mode) {
+    // Called to create a directory.
+
+    // SET UP THE RPC CALL
+    DLOG("rpc_mkdir called for '%s'", path);
+
+    int ARG_COUNT = 3;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    // Fill in the arguments
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *) path;
+
+    arg_types[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+    args[1] = (void *) &mode;
+
+    arg_types[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[2] = (void *) &returnCode;
+
+    arg_types[3] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("mkdir", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("mkdir rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    // Clean up the memory we have allocated.
+    delete []args;
+
+    // Finally return the value we got from the server.
+    return fxn_ret;
+}
+
+int rpc_unlink(void *userdata, const char *path) {
+    // Called to remove a file.
+
+    // SET UP THE RPC CALL
+    DLOG("rpc_unlink called for '%s'", path);
+
+    int ARG_COUNT = 2;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    // Fill in the arguments
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *) path;
+
+    arg_types[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[1] = (void *) &returnCode;
+
+    arg_types[2] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("unlink", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("unlink rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    // Clean up the memory we have allocated.
+    delete []args;
+
+    // Finally return the value we got from the server.
+    return fxn_ret;
+}
+
+int rpc_rmdir(void *userdata, const char *path) {
+    // Called to remove an empty directory.
+
+    // SET UP THE RPC CALL
+    DLOG("rpc_rmdir called for '%s'", path);
+
+    int ARG_COUNT = 2;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    // Fill in the arguments
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *) path;
+
+    arg_types[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[1] = (void *) &returnCode;
+
+    arg_types[2] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("rmdir", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("rmdir rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    // Clean up the memory we have allocated.
+    delete []args;
+
+    // Finally return the value we got from the server.
+    return fxn_ret;
+}
+
+int rpc_rename(void *userdata, const char *from, const char *to) {
+    // Called to move a file or directory.
+
+    // SET UP THE RPC CALL
+    DLOG("rpc_rename called for '%s' -> '%s'", from, to);
+
+    int ARG_COUNT = 3;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The paths have string length (strlen) + 1 (for the null character).
+    int fromlen = strlen(from) + 1;
+    int tolen = strlen(to) + 1;
+
+    // Fill in the arguments
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) fromlen;
+    args[0] = (void *) from;
+
+    arg_types[1] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) tolen;
+    args[1] = (void *) to;
+
+    arg_types[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[2] = (void *) &returnCode;
+
+    arg_types[3] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("rename", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("rename rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    // Clean up the memory we have allocated.
+    delete []args;
+
+    // Finally return the value we got from the server.
+    return fxn_ret;
+}
+
+int rpc_readdir(void *userdata, const char *path, off_t cookie, char *buf,
+                size_t size, off_t *next) {
+    // Read one page of at most size bytes of the listing of path, starting
+    // at entry number cookie. Returns the number of records in buf, or
+    // -errno. next is set to the cookie of the following page, or -1.
+
+    // SET UP THE RPC CALL
+    DLOG("rpc_readdir called for '%s' at %ld", path, (long) cookie);
+
+    int ARG_COUNT = 5;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    // Fill in the arguments
+    arg_types[0] =
+        (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *) path;
+
+    arg_types[1] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[1] = (void *) &cookie;
+
+    arg_types[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) size;
+    args[2] = (void *) buf;
+
+    arg_types[3] = (1u << ARG_OUTPUT) | (ARG_LONG << 16u);
+    args[3] = (void *) next;
+
+    arg_types[4] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[4] = (void *) &returnCode;
+
+    arg_types[5] = 0;
+
+    // MAKE THE RPC CALL
+    int rpc_ret = rpc_call_unlocked("readdir", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("readdir rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    // Clean up the memory we have allocated.
+    delete []args;
+
+    // Finally return the value we got from the server.
+    return fxn_ret;
+}
+
+int rpc_open_session(void *userdata, uint64_t *session) {
+    // Start a session at the server. Fills in *session and returns 0, or
+    // -errno.
+
+    DLOG("rpc_open_session called");
+
+    int ARG_COUNT = 2;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    arg_types[0] = (1u << ARG_OUTPUT) | (ARG_LONG << 16u);
+    args[0] = (void *) session;
+
+    arg_types[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[1] = (void *) &returnCode;
+
+    arg_types[2] = 0;
+
+    int rpc_ret = rpc_call_unlocked("opensession", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("opensession rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+// Send a heartbeat for session or end it (rpc_name). Returns 0, -ESTALE if
+// the session already ended, or -errno.
+static int session_call(const char *rpc_name, uint64_t session) {
+    DLOG("%s called for session %llu", rpc_name, (unsigned long long) session);
+
+    int ARG_COUNT = 2;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    arg_types[0] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[0] = (void *) &session;
+
+    arg_types[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[1] = (void *) &returnCode;
+
+    arg_types[2] = 0;
+
+    int rpc_ret = rpc_call_unlocked(rpc_name, arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("%s rpc failed with error '%d'", rpc_name, rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+int rpc_heartbeat(void *userdata, uint64_t session) {
+    return session_call("heartbeat", session);
+}
+
+int rpc_close_session(void *userdata, uint64_t session) {
+    return session_call("closesession", session);
+}
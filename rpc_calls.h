@@ -5,12 +5,22 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include "getattr_multi.h"
+
+// Default number of read/write chunks kept in flight at once. A window of 1
+// sends chunks one after another.
+#define RPC_WINDOW 4
+
+int rpc_pool_init(int window);
+
+void rpc_pool_destroy();
 
 int rpc_getattr(void *userdata, const char *path, struct stat *statbuf);
 
@@ -20,6 +30,12 @@ int rpc_open(void *userdata, const char *path, struct fuse_file_info *fi);
 
 int rpc_release(void *userdata, const char *path, struct fuse_file_info *fi);
 
+int rpc_read_chunk(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi,
+                   uint64_t session);
+
+int rpc_write_chunk(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi,
+                    uint64_t session);
+
 int rpc_read(void *userdata, const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
 int rpc_write(void *userdata, const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
@@ -30,3 +46,29 @@ int rpc_fsync(void *userdata, const char *path, struct fuse_file_info *fi);
 
 int rpc_utimensat(void *userdata, const char *path, const struct timespec ts[2]);
 
+int rpc_bulkport(void *userdata);
+
+int rpc_checksums(void *userdata, const char *path, uint64_t *hashes, size_t count, off_t first_block);
+
+int rpc_lease(void *userdata, const char *path, int client_id, const struct timespec *mtime, off_t size);
+
+int rpc_mkdir(void *userdata, const char *path, mode_t mode);
+
+int rpc_unlink(void *userdata, const char *path);
+
+int rpc_rmdir(void *userdata, const char *path);
+
+int rpc_rename(void *userdata, const char *from, const char *to);
+
+int rpc_readdir(void *userdata, const char *path, off_t cookie, char *buf, size_t size, off_t *next);
+
+int rpc_openfetch(void *userdata, const char *path, struct fuse_file_info *fi, struct stat *statbuf, char *buf, size_t size);
+
+int rpc_getattr_multi(void *userdata, const char *paths, size_t paths_len, int count, struct attr_result *results);
+
+int rpc_open_session(void *userdata, uint64_t *session);
+
+int rpc_heartbeat(void *userdata, uint64_t session);
+
+int rpc_close_session(void *userdata, uint64_t session);
+
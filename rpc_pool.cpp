@@ -0,0 +1,78 @@
+#include "rpc_pool.h"
+#include "rpc_calls.h"
+#include "debug.h"
+using namespace std;
+
+rpc_pool::rpc_pool(int num_threads) {
+    DLOG("Starting rpc pool with %d threads", num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        workers.emplace_back(&rpc_pool::worker, this);
+    }
+}
+
+void rpc_pool::worker() {
+    unique_lock<std::mutex> guard(mutex);
+    while (true) {
+        work_cv.wait(guard, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+            // stopping and nothing left to do
+            return;
+        }
+
+        struct rpc_chunk *chunk = pending.front();
+        pending.pop();
+
+        // an earlier chunk already failed, the transfer ends there anyway
+        if (*chunk->stopped) {
+            chunk->result = 0;
+        }
+        else {
+            // make the rpc without holding the pool lock so other chunks can
+            // be in flight at the same time
+            guard.unlock();
+            if (chunk->is_write) {
+                chunk->result = rpc_write_chunk(chunk->path, chunk->buf, chunk->size, chunk->offset, chunk->fi, chunk->session);
+            }
+            else {
+                chunk->result = rpc_read_chunk(chunk->path, chunk->buf, chunk->size, chunk->offset, chunk->fi, chunk->session);
+            }
+            guard.lock();
+
+            if (chunk->result < 0 || (size_t) chunk->result < chunk->size) {
+                *chunk->stopped = true;
+            }
+        }
+
+        *chunk->remaining -= 1;
+        if (*chunk->remaining == 0) {
+            done_cv.notify_all();
+        }
+    }
+}
+
+void rpc_pool::run(vector<struct rpc_chunk> &chunks) {
+    int remaining = chunks.size();
+    bool stopped = false;
+
+    unique_lock<std::mutex> guard(mutex);
+    for (auto &chunk : chunks) {
+        chunk.remaining = &remaining;
+        chunk.stopped = &stopped;
+        pending.push(&chunk);
+    }
+    work_cv.notify_all();
+
+    done_cv.wait(guard, [&remaining] { return remaining == 0; });
+}
+
+rpc_pool::~rpc_pool() {
+    {
+        lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    work_cv.notify_all();
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
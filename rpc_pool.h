@@ -0,0 +1,59 @@
+#ifndef RPC_POOL_H
+#define RPC_POOL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+struct fuse_file_info;
+
+// One piece of a read or write transfer, small enough for a single rpc.
+struct rpc_chunk {
+    bool is_write;
+    const char *path;
+    char *buf;
+    size_t size;
+    off_t offset;
+    struct fuse_file_info *fi;
+    // session fi->fh belongs to
+    uint64_t session;
+    // bytes transferred or -errno, filled in once the chunk completes
+    int result;
+    // number of chunks of the same transfer still outstanding
+    int *remaining;
+    // set once a chunk of the same transfer fails or comes up short, later
+    // chunks are then skipped with a result of 0
+    bool *stopped;
+};
+
+// A fixed set of threads that issue chunk rpcs concurrently, so a transfer
+// keeps as many requests in flight as there are threads instead of waiting a
+// full round trip per chunk.
+class rpc_pool {
+    std::vector<std::thread> workers;
+    std::queue<struct rpc_chunk *> pending;
+    std::mutex mutex;
+    // signalled when chunks are queued or the pool is stopping
+    std::condition_variable work_cv;
+    // signalled when a chunk completes
+    std::condition_variable done_cv;
+    bool stopping = false;
+
+    void worker();
+
+    public:
+
+    rpc_pool(int num_threads);
+
+    // Issue every chunk and wait for all of them to complete. Each chunk
+    // carries its own offset and buffer, so results land in place in order.
+    // Chunks not yet issued when one fails are not sent at all.
+    void run(std::vector<struct rpc_chunk> &chunks);
+
+    ~rpc_pool();
+};
+
+#endif
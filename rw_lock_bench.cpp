@@ -0,0 +1,103 @@
+//
+// Microbenchmark of rw_lock_t against rw_lock_striped_t.
+//
+// make rw_lock_bench && ./rw_lock_bench [seconds] [write percent]
+//
+// For 1, 2, 4, ... up to 4x the number of CPUs threads, every thread locks
+// one shared lock in a loop, taking it for writing the given percent of the
+// time and for reading otherwise, with a little work inside. Prints the
+// lock/unlock pairs per second of each implementation.
+//
+
+#include "rw_lock.h"
+#include "rw_lock_striped.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+using namespace std;
+
+struct plain_lock {
+    rw_lock_t lock;
+    plain_lock() { rw_lock_init(&lock); }
+    ~plain_lock() { rw_lock_destroy(&lock); }
+    void acquire(rw_lock_mode_t mode) { rw_lock_lock(&lock, mode); }
+    void release(rw_lock_mode_t mode) { rw_lock_unlock(&lock, mode); }
+};
+
+struct striped_lock {
+    rw_lock_striped_t lock;
+    striped_lock() { rw_lock_striped_init(&lock); }
+    ~striped_lock() { rw_lock_striped_destroy(&lock); }
+    void acquire(rw_lock_mode_t mode) { rw_lock_striped_lock(&lock, mode); }
+    void release(rw_lock_mode_t mode) { rw_lock_striped_unlock(&lock, mode); }
+};
+
+// Run num_threads threads against one lock of type T for seconds. Returns the
+// pairs per second, or -1 if a reader ever saw a writer inside.
+template <typename T>
+static double run(int num_threads, double seconds, int write_percent) {
+    T lock;
+    atomic<bool> stop(false);
+    atomic<bool> broken(false);
+    atomic<long> total(0);
+    // written under the write lock only, readers check it never moves
+    volatile long shared = 0;
+
+    vector<thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        threads.emplace_back([&, i] {
+            unsigned int seed = i + 1;
+            long count = 0;
+            while (!stop.load(memory_order_relaxed)) {
+                bool write = (int) (rand_r(&seed) % 100) < write_percent;
+                rw_lock_mode_t mode = write ? RW_WRITE_LOCK : RW_READ_LOCK;
+                lock.acquire(mode);
+                if (write) {
+                    shared = shared + 1;
+                }
+                else {
+                    long seen = shared;
+                    for (int spin = 0; spin < 20; spin++) {
+                        if (shared != seen) {
+                            broken = true;
+                        }
+                    }
+                }
+                lock.release(mode);
+                count++;
+            }
+            total += count;
+        });
+    }
+
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+    stop = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    return broken ? -1 : total / seconds;
+}
+
+int main(int argc, char **argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1;
+    int write_percent = argc > 2 ? atoi(argv[2]) : 1;
+    int max_threads = 4 * max(1u, thread::hardware_concurrency());
+
+    printf("%d%% writes, %.1fs per run\n", write_percent, seconds);
+    printf("%8s %16s %16s\n", "threads", "rw_lock/s", "striped/s");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double plain = run<plain_lock>(n, seconds, write_percent);
+        double striped = run<striped_lock>(n, seconds, write_percent);
+        if (plain < 0 || striped < 0) {
+            printf("a reader saw a writer inside the lock\n");
+            return 1;
+        }
+        printf("%8d %16.0f %16.0f\n", n, plain, striped);
+    }
+    return 0;
+}
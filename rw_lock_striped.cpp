@@ -0,0 +1,158 @@
+#include "rw_lock_striped.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using namespace std;
+
+// Sleep while *word still holds seen. Returns early on any change to word,
+// a signal or a spurious wakeup, callers check their condition again.
+static void futex_wait(atomic<uint32_t> *word, uint32_t seen) {
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic<uint32_t> *word, int count) {
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// The stripe of the calling thread. Threads are spread round robin, so up to
+// RW_LOCK_STRIPES readers never share a counter.
+static int my_stripe() {
+    static atomic<int> next_stripe(0);
+    static thread_local int stripe = next_stripe++ % RW_LOCK_STRIPES;
+    return stripe;
+}
+
+static int num_readers(rw_lock_striped_t *lock) {
+    int readers = 0;
+    for (int i = 0; i < RW_LOCK_STRIPES; i++) {
+        readers += lock->stripes_[i].readers.load();
+    }
+    return readers;
+}
+
+// Tell a writer waiting for readers to leave that one did.
+static void reader_left(rw_lock_striped_t *lock) {
+    if (lock->writer_.load() != 0) {
+        lock->drain_ += 1;
+        futex_wake(&lock->drain_, 1);
+    }
+}
+
+int rw_lock_striped_init(rw_lock_striped_t *lock) {
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+
+    for (int i = 0; i < RW_LOCK_STRIPES; i++) {
+        lock->stripes_[i].readers = 0;
+    }
+    lock->writer_ = 0;
+    lock->waiting_readers_ = 0;
+    lock->waiting_writers_ = 0;
+    lock->reader_gate_ = 0;
+    lock->writer_gate_ = 0;
+    lock->drain_ = 0;
+
+    return 0;
+}
+
+int rw_lock_striped_destroy(rw_lock_striped_t *lock) {
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int rw_lock_striped_lock(rw_lock_striped_t *lock, rw_lock_mode_t mode) {
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+
+    if (mode == RW_READ_LOCK) {
+        atomic<int> &readers = lock->stripes_[my_stripe()].readers;
+        for (;;) {
+            // the increment and the check of writer_ pair with the writer
+            // setting writer_ and then counting readers, so one of the two
+            // always sees the other
+            readers += 1;
+            if (lock->writer_.load() == 0) {
+                return 0;
+            }
+
+            // a writer holds or wants the lock, get out of its way
+            readers -= 1;
+            reader_left(lock);
+
+            lock->waiting_readers_ += 1;
+            uint32_t seen = lock->reader_gate_.load();
+            if (lock->writer_.load() != 0) {
+                futex_wait(&lock->reader_gate_, seen);
+            }
+            lock->waiting_readers_ -= 1;
+        }
+    }
+
+    // one writer at a time
+    for (;;) {
+        int free = 0;
+        if (lock->writer_.compare_exchange_strong(free, 1)) {
+            break;
+        }
+
+        lock->waiting_writers_ += 1;
+        uint32_t seen = lock->writer_gate_.load();
+        if (lock->writer_.load() != 0) {
+            futex_wait(&lock->writer_gate_, seen);
+        }
+        lock->waiting_writers_ -= 1;
+    }
+
+    // new readers now back off, wait for those already in to leave
+    for (;;) {
+        uint32_t seen = lock->drain_.load();
+        if (num_readers(lock) == 0) {
+            return 0;
+        }
+        futex_wait(&lock->drain_, seen);
+    }
+}
+
+int rw_lock_striped_unlock(rw_lock_striped_t *lock, rw_lock_mode_t mode) {
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+
+    if (mode == RW_READ_LOCK) {
+        atomic<int> &readers = lock->stripes_[my_stripe()].readers;
+        if (readers.load() <= 0) {
+            // You don't actually hold a lock.
+            return -EPERM;
+        }
+        readers -= 1;
+        reader_left(lock);
+        return 0;
+    }
+
+    int held = 1;
+    if (!lock->writer_.compare_exchange_strong(held, 0)) {
+        // You don't actually hold a lock.
+        return -EPERM;
+    }
+
+    // wake every waiting reader and one waiting writer; each counter is read
+    // after its gate moves, pairing with the waiter counting itself before
+    // it reads the gate
+    lock->reader_gate_ += 1;
+    if (lock->waiting_readers_.load() > 0) {
+        futex_wake(&lock->reader_gate_, INT_MAX);
+    }
+    lock->writer_gate_ += 1;
+    if (lock->waiting_writers_.load() > 0) {
+        futex_wake(&lock->writer_gate_, 1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef RW_LOCK_STRIPED_H
+#define RW_LOCK_STRIPED_H
+
+#include <atomic>
+#include <stdint.h>
+#include "rw_lock.h"
+
+// A readers-writer lock with the interface of rw_lock_t, for locks taken by
+// many readers at once. Each reader only touches the counter of its own
+// stripe, so readers don't contend on a shared mutex, and nothing is taken
+// at all while no writer is around. Waiters sleep on futexes: a writer's
+// unlock wakes every waiting reader and one waiting writer, and readers wake
+// only the writer waiting for them to leave.
+//
+// Like rw_lock_t, a writer that is waiting keeps new readers out, so writers
+// aren't starved. A read lock must be released by the thread that took it.
+
+// Number of reader counters per lock, each on its own cache line.
+#define RW_LOCK_STRIPES 16
+
+typedef struct rw_lock_striped {
+    struct alignas(64) stripe {
+        std::atomic<int> readers;
+    };
+
+    // active readers, spread by thread
+    struct stripe stripes_[RW_LOCK_STRIPES];
+
+    // 1 while a writer holds the lock or waits for readers to leave it
+    alignas(64) std::atomic<int> writer_;
+    // threads asleep on the gates below
+    std::atomic<int> waiting_readers_;
+    std::atomic<int> waiting_writers_;
+    // futex words, bumped when a writer releases the lock
+    std::atomic<uint32_t> reader_gate_;
+    std::atomic<uint32_t> writer_gate_;
+    // futex word the writer sleeps on while readers leave, bumped by them
+    std::atomic<uint32_t> drain_;
+} rw_lock_striped_t;
+
+// FUNCTIONS
+// All functions return 0 on success or an error number to indicate the error.
+
+int rw_lock_striped_init(rw_lock_striped_t *lock);
+int rw_lock_striped_destroy(rw_lock_striped_t *lock);
+
+// Acquire the lock in mode (RW_READ_LOCK, RW_WRITE_LOCK).
+int rw_lock_striped_lock(rw_lock_striped_t *lock, rw_lock_mode_t mode);
+// Release the lock from mode (RW_READ_LOCK, RW_WRITE_LOCK).
+int rw_lock_striped_unlock(rw_lock_striped_t *lock, rw_lock_mode_t mode);
+
+#endif
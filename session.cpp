@@ -0,0 +1,219 @@
+#include "session.h"
+#include "global.h"
+#include "debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+session_table::session_table(int timeout_seconds, server_mutex *open_files, fd_cache *fds,
+                             range_lock_table *ranges)
+    : timeout(timeout_seconds), open_files(open_files), fds(fds), ranges(ranges) {
+    urandom = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (urandom < 0) {
+        DLOG("SESSION: Could not open /dev/urandom, using random_device");
+    }
+    reaper = thread(&session_table::reap_loop, this);
+}
+
+uint64_t session_table::random_id() {
+    uint64_t id = 0;
+    if (urandom < 0 || read(urandom, &id, sizeof(id)) != sizeof(id)) {
+        // the library's source, two draws per id
+        random_device device;
+        id = ((uint64_t) device() << 32) | device();
+    }
+    return id;
+}
+
+// End the sessions that missed their heartbeats, every SESSION_REAP_SECONDS
+// or more often for short timeouts.
+void session_table::reap_loop() {
+    auto interval = min(timeout, chrono::seconds(SESSION_REAP_SECONDS));
+    unique_lock<mutex> guard(lock);
+
+    while (!reaper_stopping) {
+        reaper_cv.wait_for(guard, interval);
+
+        auto now = chrono::steady_clock::now();
+        vector<uint64_t> expired;
+        vector<struct handle> closed;
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            if (it->second.expires > now) {
+                it++;
+                continue;
+            }
+
+            DLOG("SESSION: Session %llu expired with %zu handles open",
+                 (unsigned long long) it->first, it->second.handles.size());
+            for (uint64_t handle : it->second.handles) {
+                closed.push_back(handles[handle]);
+                handles.erase(handle);
+            }
+            expired.push_back(it->first);
+            it = sessions.erase(it);
+        }
+
+        if (expired.empty()) {
+            continue;
+        }
+
+        // releasing takes the other tables' locks, never hold ours meanwhile
+        guard.unlock();
+        close_handles(closed);
+        for (uint64_t session : expired) {
+            ranges->drop_owner(session);
+        }
+        guard.lock();
+    }
+}
+
+void session_table::close_handles(const vector<struct handle> &closed) {
+    for (auto &handle : closed) {
+        char *path = const_cast<char *>(handle.path.c_str());
+        fds->release(handle.fd);
+        open_files->release_file(path, handle.flags);
+    }
+}
+
+uint64_t session_table::open() {
+    lock_guard<mutex> guard(lock);
+
+    // random ids, so a client from before a restart can't pick up a new
+    // client's session
+    uint64_t session = 0;
+    while (session == 0 || sessions.count(session) > 0) {
+        session = random_id();
+    }
+    sessions[session].expires = chrono::steady_clock::now() + timeout;
+
+    DLOG("SESSION: Session %llu opened", (unsigned long long) session);
+    return session;
+}
+
+int session_table::heartbeat(uint64_t session) {
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = sessions.find(session);
+        if (it == sessions.end()) {
+            return -ESTALE;
+        }
+        it->second.expires = chrono::steady_clock::now() + timeout;
+    }
+
+    ranges->renew(session);
+    return 0;
+}
+
+int session_table::close(uint64_t session) {
+    vector<struct handle> closed;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = sessions.find(session);
+        if (it == sessions.end()) {
+            return -ESTALE;
+        }
+        for (uint64_t handle : it->second.handles) {
+            closed.push_back(handles[handle]);
+            handles.erase(handle);
+        }
+        sessions.erase(it);
+    }
+
+    DLOG("SESSION: Session %llu closed with %zu handles open",
+         (unsigned long long) session, closed.size());
+    close_handles(closed);
+    ranges->drop_owner(session);
+    return 0;
+}
+
+int session_table::open_handle(uint64_t session, char *path, int flags, uint64_t *handle) {
+    {
+        lock_guard<mutex> guard(lock);
+        if (sessions.count(session) == 0) {
+            return -ESTALE;
+        }
+    }
+
+    // add/update file metadata, refusing a second writer
+    int ret = open_files->open_file(path, flags);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // reuse the cached descriptor for this path if there is one
+    int fd = fds->acquire(path);
+    if (fd < 0) {
+        open_files->release_file(path, flags);
+        return fd;
+    }
+
+    struct handle opened = {session, string(path), fd, flags};
+    {
+        lock_guard<mutex> guard(lock);
+        // the session may have ended while the file was opened
+        auto it = sessions.find(session);
+        if (it != sessions.end()) {
+            // random like session ids, so another client can't guess them
+            uint64_t opened_handle = 0;
+            while (opened_handle == 0 || handles.count(opened_handle) > 0) {
+                opened_handle = random_id();
+            }
+            *handle = opened_handle;
+            handles[*handle] = opened;
+            it->second.handles.insert(*handle);
+            return 0;
+        }
+    }
+
+    close_handles({opened});
+    return -ESTALE;
+}
+
+int session_table::close_handle(uint64_t session, uint64_t handle) {
+    struct handle closed;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = handles.find(handle);
+        if (it == handles.end() || it->second.session != session) {
+            return -EBADF;
+        }
+        closed = it->second;
+        sessions[closed.session].handles.erase(handle);
+        handles.erase(it);
+    }
+
+    close_handles({closed});
+    return 0;
+}
+
+int session_table::use(uint64_t session, uint64_t handle, bool write) {
+    lock_guard<mutex> guard(lock);
+    auto it = handles.find(handle);
+    if (it == handles.end() || it->second.session != session) {
+        return -EBADF;
+    }
+    // descriptors are shared by path and opened for writing, so the
+    // handle's own flags decide
+    if (write && (it->second.flags & O_ACCMODE) == O_RDONLY) {
+        return -EBADF;
+    }
+    // taken under our lock, so the handle can't be closed in between
+    return fds->hold(it->second.fd);
+}
+
+void session_table::done(int fd) {
+    fds->release(fd);
+}
+
+session_table::~session_table() {
+    {
+        lock_guard<mutex> guard(lock);
+        reaper_stopping = true;
+    }
+    reaper_cv.notify_all();
+    reaper.join();
+    if (urandom >= 0) {
+        ::close(urandom);
+    }
+}
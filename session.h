@@ -0,0 +1,29 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "global.h"
+
+// Every client holds a session at the server, see session_table in global.h.
+// The session id also owns the client's range locks, which its heartbeats
+// renew.
+
+// Default number of seconds a session lasts without a heartbeat.
+#define SESSION_SECONDS 60
+
+// How often a client sends a heartbeat. Must stay well below the session
+// timeout and the lock lease of the server.
+#define SESSION_HEARTBEAT_SECONDS 5
+
+// Longest the server waits between looking for expired sessions.
+#define SESSION_REAP_SECONDS 5
+
+// CLIENT FUNCTIONS
+
+// Open a session and start sending heartbeats for it. Returns 0 or -errno;
+// without a session the heartbeat thread keeps trying to open one.
+int session_client_init(struct files_store *user);
+
+// Stop the heartbeats and end the session, closing whatever it left open.
+void session_client_destroy(struct files_store *user);
+
+#endif
@@ -0,0 +1,68 @@
+#include "session.h"
+#include "global.h"
+#include "rpc_calls.h"
+#include "debug.h"
+#include <errno.h>
+using namespace std;
+
+// Open a new session and make it this client's. Opens and locks made under
+// an earlier session are gone at the server by then.
+static int start_session(struct files_store *user) {
+    uint64_t session = 0;
+    int returnCode = rpc_open_session(user, &session);
+    if (returnCode < 0) {
+        DLOG("SESSION: Could not open a session: %d", returnCode);
+        return returnCode;
+    }
+
+    DLOG("SESSION: Session %llu opened", (unsigned long long) session);
+    user->session_id = session;
+    return 0;
+}
+
+// Send a heartbeat every SESSION_HEARTBEAT_SECONDS until
+// session_client_destroy. If the session ended at the server, e.g. because
+// the client was cut off for longer than the timeout, start a new one so
+// later opens work again.
+static void heartbeat_loop(struct files_store *user) {
+    unique_lock<mutex> guard(user->heartbeat_mutex);
+
+    while (!user->heartbeat_stopping) {
+        user->heartbeat_cv.wait_for(guard, chrono::seconds(SESSION_HEARTBEAT_SECONDS));
+        if (user->heartbeat_stopping) {
+            break;
+        }
+
+        guard.unlock();
+        uint64_t session = user->session_id;
+        if (session == 0 || rpc_heartbeat(user, session) == -ESTALE) {
+            start_session(user);
+        }
+        guard.lock();
+    }
+}
+
+int session_client_init(struct files_store *user) {
+    int returnCode = start_session(user);
+    user->heartbeat = thread(heartbeat_loop, user);
+    return returnCode;
+}
+
+void session_client_destroy(struct files_store *user) {
+    if (!user->heartbeat.joinable()) {
+        return;
+    }
+
+    {
+        lock_guard<mutex> guard(user->heartbeat_mutex);
+        user->heartbeat_stopping = true;
+    }
+    user->heartbeat_cv.notify_all();
+    user->heartbeat.join();
+
+    // let the server close what is left right away rather than after the
+    // timeout
+    if (user->session_id != 0) {
+        rpc_close_session(user, user->session_id);
+    }
+}
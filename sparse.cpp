@@ -0,0 +1,221 @@
+#include "sparse.h"
+#include "attr_cache.h"
+#include "cache_index.h"
+#include "checksum.h"
+#include "utils.h"
+#include "debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+using namespace std;
+
+static void mark_present(struct file_info *file, off_t block_num) {
+    if (!file->present[block_num]) {
+        file->present[block_num] = true;
+        file->num_missing -= 1;
+    }
+}
+
+int reset_sparse_copy(void *userdata, const char *path, struct file_info *file) {
+    struct files_store *user = (struct files_store *) userdata;
+
+    // the version decides whether the cached blocks can be kept
+    struct stat server;
+    int returnCode = fetch_server_attr(userdata, path, &server);
+
+    if (returnCode < 0) {
+        DLOG("Sparse: Could not retrieve file attr from server");
+        return returnCode;
+    }
+
+    struct cache_entry *entry = find_cache_entry(user, path);
+    if (entry != nullptr && is_cache_entry_current(entry, &server)) {
+        DLOG("Sparse: Cached copy is current");
+        touch_cache_entry(user, entry);
+        file->present.clear();
+        file->num_missing = 0;
+        record_version(file, &server);
+        return 0;
+    }
+
+    // the local copy won't hold a whole version of the file for a while
+    forget_cache_entry(user, path);
+
+    if (ftruncate(file->client_fi, server.st_size) < 0) {
+        DLOG("Sparse: Could not size local copy");
+        return -errno;
+    }
+
+    off_t num_blocks = (server.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    file->present.assign(num_blocks, false);
+    file->num_missing = num_blocks;
+
+    // blocks this client wrote are newer than the server's
+    for (auto it = file->dirty.begin(); it != file->dirty.end(); it++) {
+        off_t last = min((it->second - 1) / BLOCK_SIZE, num_blocks - 1);
+        for (off_t block_num = it->first / BLOCK_SIZE; block_num <= last; block_num++) {
+            mark_present(file, block_num);
+        }
+    }
+
+    if (file->num_missing == 0) {
+        file->present.clear();
+    }
+
+    // T_client follows T_server, as after a download
+    struct timespec ts[2];
+    ts[0] = server.st_mtim;
+    ts[1] = server.st_mtim;
+    if (futimens(file->client_fi, ts) < 0) {
+        DLOG("Sparse: Could not update file metadata at client");
+        return -errno;
+    }
+    record_version(file, &server);
+
+    DLOG("Sparse: %ld of %ld blocks left to fetch on demand", (long) file->num_missing,
+         (long) num_blocks);
+    return 0;
+}
+
+// Fetch the blocks under a read lock of their run, or return -ESTALE if the
+// server no longer has the version the copy was reset to.
+static int fetch_run(void *userdata, const char *path, struct file_info *file,
+                     off_t run_offset, off_t run_len, struct fuse_file_info *fi) {
+    int returnCode = lock_range(userdata, path, run_offset, run_len, RW_READ_LOCK);
+    if (returnCode < 0) {
+        return returnCode;
+    }
+
+    // the lock only keeps uploads out while it is held, one may have landed
+    // since the copy was reset
+    struct stat server;
+    returnCode = fetch_server_attr(userdata, path, &server);
+    if (returnCode == 0) {
+        if (!file->version_known) {
+            // only this client can have written since, e.g. an upload of its
+            // own, so the server's blocks are the ones the copy lacks
+            record_version(file, &server);
+        }
+        else if (!same_version(&file->version, &server)) {
+            DLOG("Sparse: '%s' changed at the server since the copy was reset", path);
+            returnCode = -ESTALE;
+        }
+    }
+
+    if (returnCode == 0) {
+        returnCode = fetch_range_from_server(userdata, path, file->client_fi,
+                                             run_offset, run_len, fi);
+    }
+    unlock_range(userdata, path, run_offset, run_len, RW_READ_LOCK);
+    return returnCode;
+}
+
+static int fetch_blocks(void *userdata, const char *path, struct file_info *file,
+                        off_t offset, size_t size, bool overwrite) {
+    off_t num_blocks = file->present.size();
+    if (file->num_missing == 0 || size == 0 || offset >= num_blocks * BLOCK_SIZE) {
+        return 0;
+    }
+
+    // fetching writes the local copy, but must not change T_client
+    struct stat local;
+    if (fstat(file->client_fi, &local) < 0) {
+        DLOG("Sparse: Could not stat local copy");
+        return -errno;
+    }
+
+    struct fuse_file_info fi;
+    fi.flags = O_RDONLY;
+    fi.fh = file->server_fi;
+
+    int returnCode = 0;
+    off_t end = offset + size;
+    off_t last = min((end - 1) / BLOCK_SIZE, num_blocks - 1);
+
+    // first block of the current run of missing blocks, -1 if none
+    off_t run_start = -1;
+
+    for (off_t block_num = offset / BLOCK_SIZE; block_num <= last + 1 && returnCode == 0; block_num++) {
+        bool missing = block_num <= last && !file->present[block_num];
+
+        if (missing && overwrite && block_num * BLOCK_SIZE >= offset &&
+            (block_num + 1) * BLOCK_SIZE <= end) {
+            mark_present(file, block_num);
+            missing = false;
+        }
+
+        if (missing) {
+            if (run_start < 0) {
+                run_start = block_num;
+            }
+        }
+        else if (run_start >= 0) {
+            // an upload may be rewriting other parts of the file meanwhile
+            off_t run_offset = run_start * BLOCK_SIZE;
+            off_t run_len = (block_num - run_start) * BLOCK_SIZE;
+            returnCode = fetch_run(userdata, path, file, run_offset, run_len, &fi);
+            for (off_t fetched = run_start; returnCode == 0 && fetched < block_num; fetched++) {
+                mark_present(file, fetched);
+            }
+            run_start = -1;
+        }
+    }
+
+    struct timespec ts[2];
+    ts[0] = local.st_atim;
+    ts[1] = local.st_mtim;
+    if (futimens(file->client_fi, ts) < 0 && returnCode == 0) {
+        DLOG("Sparse: Could not restore file metadata at client");
+        returnCode = -errno;
+    }
+
+    if (file->num_missing == 0) {
+        DLOG("Sparse: All blocks of '%s' fetched", path);
+        file->present.clear();
+    }
+
+    return returnCode;
+}
+
+int fetch_missing_blocks(void *userdata, const char *path, struct file_info *file,
+                         off_t offset, size_t size, bool overwrite) {
+    int returnCode = fetch_blocks(userdata, path, file, offset, size, overwrite);
+    if (returnCode != -ESTALE) {
+        return returnCode;
+    }
+
+    // never mix in blocks of the newer version, start over from it instead
+    returnCode = reset_sparse_copy(userdata, path, file);
+    if (returnCode < 0) {
+        return returnCode;
+    }
+    return fetch_blocks(userdata, path, file, offset, size, overwrite);
+}
+
+int truncate_sparse_copy(void *userdata, const char *path, struct file_info *file, off_t size) {
+    // the part of the last block that is kept still has to come from the server
+    if (size % BLOCK_SIZE != 0) {
+        int returnCode = fetch_missing_blocks(userdata, path, file, size, 1, false);
+        if (returnCode < 0) {
+            return returnCode;
+        }
+    }
+
+    if (file->num_missing == 0) {
+        return 0;
+    }
+
+    // blocks past the old end are zeros and need no fetching
+    off_t num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    file->present.resize(num_blocks, true);
+    file->num_missing = count(file->present.begin(), file->present.end(), false);
+
+    if (file->num_missing == 0) {
+        file->present.clear();
+    }
+
+    return 0;
+}
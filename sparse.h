@@ -0,0 +1,28 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <sys/types.h>
+#include "global.h"
+
+// In sparse mode (WATDFS_SPARSE) open doesn't download the file. The local
+// copy is sized like the server's and each block is fetched the first time a
+// read or a partial write touches it. file_info::present tracks which blocks
+// have been fetched.
+
+// Make the open local copy of path follow the server's current version, with
+// every block not written by this client marked missing. Nothing changes if
+// the cache index says the local copy is already current.
+int reset_sparse_copy(void *userdata, const char *path, struct file_info *file);
+
+// Fetch the missing blocks of file covering [offset, offset + size). With
+// overwrite set, blocks the range covers completely are about to be written
+// and are only marked present. If another client uploaded since the copy was
+// reset, the copy is reset to the new version first. Returns -ESTALE if the
+// file changed again meanwhile.
+int fetch_missing_blocks(void *userdata, const char *path, struct file_info *file,
+                         off_t offset, size_t size, bool overwrite);
+
+// Follow a truncate of the local copy to size.
+int truncate_sparse_copy(void *userdata, const char *path, struct file_info *file, off_t size);
+
+#endif
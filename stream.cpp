@@ -0,0 +1,136 @@
+#include "stream.h"
+#include "rpc_calls.h"
+#include "debug.h"
+#include <algorithm>
+#include <string.h>
+using namespace std;
+
+static off_t chunk_start(off_t offset) {
+    return offset - offset % STREAM_CHUNK_SIZE;
+}
+
+stream_reader::stream_reader(void *userdata, const char *path, uint64_t server_fh, off_t size)
+    : userdata(userdata), path(path), size(size) {
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    fi.fh = server_fh;
+    fetcher = thread(&stream_reader::fetch_loop, this);
+}
+
+// Pick the first chunk in the read-ahead window that isn't in the ring.
+// Called with mutex held.
+bool stream_reader::next_fetch(off_t *offset) {
+    off_t end = max(position + window * STREAM_CHUNK_SIZE, wanted_end);
+    end = min(end, size);
+
+    for (off_t next = chunk_start(position); next < end; next += STREAM_CHUNK_SIZE) {
+        if (ring.find(next) == ring.end()) {
+            *offset = next;
+            return true;
+        }
+    }
+    return false;
+}
+
+void stream_reader::fetch_loop() {
+    unique_lock<std::mutex> guard(mutex);
+
+    while (!stopping) {
+        off_t offset;
+        if (!next_fetch(&offset)) {
+            fetch_cv.wait(guard);
+            continue;
+        }
+
+        // claim the chunk, then fetch it without holding the lock
+        ring[offset];
+        guard.unlock();
+
+        size_t len = min((off_t) STREAM_CHUNK_SIZE, size - offset);
+        vector<char> data(len);
+        int result = rpc_read(userdata, path.c_str(), data.data(), len, offset, &fi);
+
+        guard.lock();
+
+        // the reader may have seeked away in the meantime
+        auto it = ring.find(offset);
+        if (it != ring.end()) {
+            it->second.data.swap(data);
+            it->second.result = result;
+            it->second.ready = true;
+            ready_cv.notify_all();
+        }
+    }
+}
+
+int stream_reader::read(char *buf, size_t len, off_t offset) {
+    if (offset >= size) {
+        return 0;
+    }
+    len = min((off_t) len, size - offset);
+
+    unique_lock<std::mutex> guard(mutex);
+
+    // grow the read-ahead while the reader stays sequential, otherwise drop
+    // what was read ahead and start small again
+    if (offset == position) {
+        window = min(window * 2, (off_t) STREAM_MAX_WINDOW);
+    }
+    else {
+        DLOG("Stream: Seek to %ld, shrinking read-ahead", (long) offset);
+        window = STREAM_MIN_WINDOW;
+        ring.clear();
+    }
+    position = offset;
+    wanted_end = offset + len;
+    fetch_cv.notify_one();
+
+    size_t done = 0;
+    int fxn_ret = 0;
+    while (done < len) {
+        off_t cur = offset + done;
+        auto it = ring.find(chunk_start(cur));
+
+        if (it == ring.end() || !it->second.ready) {
+            ready_cv.wait(guard);
+            continue;
+        }
+
+        if (it->second.result < 0) {
+            DLOG("Stream: Could not read chunk from server");
+            fxn_ret = it->second.result;
+            ring.erase(it);
+            break;
+        }
+
+        // the file at the server ended early
+        off_t available = it->second.result - (cur - it->first);
+        if (available <= 0) {
+            break;
+        }
+
+        size_t n = min((size_t) available, len - done);
+        memcpy(buf + done, it->second.data.data() + (cur - it->first), n);
+        done += n;
+    }
+
+    // chunks behind the reader are done with
+    position = offset + done;
+    wanted_end = position;
+    ring.erase(ring.begin(), ring.lower_bound(chunk_start(position)));
+    fetch_cv.notify_one();
+
+    if (done == 0 && fxn_ret < 0) {
+        return fxn_ret;
+    }
+    return done;
+}
+
+stream_reader::~stream_reader() {
+    {
+        lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    fetch_cv.notify_all();
+    fetcher.join();
+}
@@ -0,0 +1,68 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fuse.h>
+#include <sys/types.h>
+
+// Bytes fetched from the server per read-ahead chunk.
+#define STREAM_CHUNK_SIZE (1024 * 1024)
+
+// Bounds, in chunks, of the read-ahead window. The window doubles with every
+// sequential read and falls back to the minimum on a seek.
+#define STREAM_MIN_WINDOW 1
+#define STREAM_MAX_WINDOW 32
+
+// Serves reads of a file opened O_RDONLY in streaming mode straight from the
+// server, without a copy in the cache. A background thread keeps the chunks
+// ahead of the reader in an in-memory ring.
+class stream_reader {
+    struct chunk {
+        std::vector<char> data;
+        // bytes fetched or -errno, valid once ready
+        int result = 0;
+        bool ready = false;
+    };
+
+    void *userdata;
+    std::string path;
+    struct fuse_file_info fi;
+    // size of the file when it was opened, reads stop there
+    off_t size;
+
+    std::mutex mutex;
+    // signalled when the fetcher has more to do or is stopping
+    std::condition_variable fetch_cv;
+    // signalled when a chunk is ready
+    std::condition_variable ready_cv;
+    // chunks fetched or being fetched, by offset
+    std::map<off_t, struct chunk> ring;
+    // where the reader is expected to read next, and the end of the read
+    // currently waiting
+    off_t position = 0;
+    off_t wanted_end = 0;
+    // read-ahead in chunks
+    off_t window = STREAM_MIN_WINDOW;
+    bool stopping = false;
+    std::thread fetcher;
+
+    bool next_fetch(off_t *offset);
+
+    void fetch_loop();
+
+    public:
+
+    stream_reader(void *userdata, const char *path, uint64_t server_fh, off_t size);
+
+    // Copy up to len bytes at offset into buf. Returns the bytes read or -errno.
+    int read(char *buf, size_t len, off_t offset);
+
+    ~stream_reader();
+};
+
+#endif
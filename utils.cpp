@@ -5,8 +5,18 @@
 #include "debug.h"
 #include "rpc_calls.h"
 #include "rpc.h"
+#include "checksum.h"
+#include "cache_index.h"
+#include "attr_cache.h"
+#include "sparse.h"
+#include "lease.h"
+#include "lock_lease.h"
+#include "client_lock.h"
 #include <fcntl.h>
 #include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <vector>
 using namespace std;
 
 char *get_full_path(const char *short_path, void *userdata) {
@@ -26,6 +36,40 @@ char *get_full_path(const char *short_path, void *userdata) {
     return full_path;
 }
 
+// Create the directories leading up to full_path inside the cache, so a file
+// in a server subdirectory has somewhere to be cached.
+int make_cache_dirs(void *userdata, const char *full_path) {
+    struct files_store *user = (struct files_store *) userdata;
+    string dirs(full_path);
+
+    for (size_t slash = dirs.find('/', strlen(user->path_to_cache) + 1);
+         slash != string::npos; slash = dirs.find('/', slash + 1)) {
+        if (mkdir(dirs.substr(0, slash).c_str(), 0777) < 0 && errno != EEXIST) {
+            DLOG("Could not create cache directory");
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+// Read an integer tuning knob from the environment, the same way the rpc
+// library reads SERVER_ADDRESS and SERVER_PORT.
+long get_config(const char *name, long default_value) {
+    const char *value = getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return default_value;
+    }
+
+    char *end = nullptr;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0') {
+        DLOG("Ignoring invalid value '%s' for %s", value, name);
+        return default_value;
+    }
+
+    return parsed;
+}
+
 int get_access_mode(int flag) {
     return flag & O_ACCMODE;
 }
@@ -37,12 +81,26 @@ bool file_already_open(void *userdata, char *full_path) {
     return it != user->cur_open_files.end();
 }
 
-int lock(const char *path, rw_lock_mode_t mode) {
+bool tree_already_open(void *userdata, char *full_path) {
+    struct files_store *user = (struct files_store *) userdata;
+    if (file_already_open(userdata, full_path)) {
+        return true;
+    }
+
+    // paths below the directory sort right after its name and a slash
+    string prefix = string(full_path) + "/";
+    auto it = user->cur_open_files.lower_bound(prefix);
+    return it != user->cur_open_files.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+}
 
+// Ask for a range lock. Returns 0 if it was granted, or -EINPROGRESS with
+// the request queued at the server under *ticket.
+static int request_range(const char *path, off_t offset, off_t len, rw_lock_mode_t mode,
+                         uint64_t owner, uint64_t *ticket) {
     // SET UP THE RPC CALL
-    DLOG("lock called for '%s'", path);
-    
-    int ARG_COUNT = 3;
+    DLOG("request_range called for '%s' [%ld, +%ld)", path, (long) offset, (long) len);
+
+    int ARG_COUNT = 7;
 
     void **args = new void*[ARG_COUNT];
 
@@ -56,21 +114,33 @@ int lock(const char *path, rw_lock_mode_t mode) {
         (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
     args[0] = (void *) path;
 
-    arg_types[1] = (1u << ARG_INPUT) |  (ARG_INT << 16u);
-    args[1] = (void *) &mode;
+    arg_types[1] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[1] = (void *) &offset;
 
-    arg_types[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    arg_types[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[2] = (void *) &len;
+
+    arg_types[3] = (1u << ARG_INPUT) |  (ARG_INT << 16u);
+    args[3] = (void *) &mode;
+
+    arg_types[4] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[4] = (void *) &owner;
+
+    arg_types[5] = (1u << ARG_OUTPUT) | (ARG_LONG << 16u);
+    args[5] = (void *) ticket;
+
+    arg_types[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
     int returnCode = 0;
-    args[2] = (void *) &returnCode;
+    args[6] = (void *) &returnCode;
 
-    arg_types[3] = 0;
+    arg_types[7] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"lock", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("lockrange", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
-        DLOG("lock rpc failed with error '%d'", rpc_ret);
+        DLOG("lockrange rpc failed with error '%d'", rpc_ret);
         fxn_ret = -EINVAL;
     } else {
         fxn_ret = returnCode;
@@ -83,11 +153,82 @@ int lock(const char *path, rw_lock_mode_t mode) {
     return fxn_ret;
 }
 
-int unlock(const char *path, rw_lock_mode_t mode) {
+// Poll or cancel (rpc_name) a queued range lock request.
+static int ticket_call(const char *rpc_name, uint64_t ticket) {
+    DLOG("%s called for ticket %llu", rpc_name, (unsigned long long) ticket);
+
+    int ARG_COUNT = 2;
+
+    void **args = new void*[ARG_COUNT];
+
+    int arg_types[ARG_COUNT + 1];
+
+    arg_types[0] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[0] = (void *) &ticket;
+
+    arg_types[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    int returnCode = 0;
+    args[1] = (void *) &returnCode;
+
+    arg_types[2] = 0;
+
+    int rpc_ret = rpc_call_unlocked(rpc_name, arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("%s rpc failed with error '%d'", rpc_name, rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = returnCode;
+    }
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+// A contended range is queued at the server, which hands back a ticket to
+// poll instead of holding an rpc thread until the range is free. Poll with
+// backoff until it is granted or lock_timeout seconds have passed. A holder
+// that died loses its range when its lease runs out, well within the default
+// timeout.
+int lock_range(void *userdata, const char *path, off_t offset, off_t len, rw_lock_mode_t mode) {
+    struct files_store *user = (struct files_store *) userdata;
+    time_t give_up = time(0) + user->lock_timeout;
+
+    uint64_t ticket = 0;
+    // ranges belong to the session, whose heartbeats renew them
+    int returnCode = request_range(path, offset, len, mode, user->session_id, &ticket);
+
+    useconds_t wait_ms = LOCK_POLL_MIN_MS;
+    while (returnCode == -EINPROGRESS) {
+        if (time(0) >= give_up) {
+            ticket_call("cancelrange", ticket);
+            returnCode = -ETIMEDOUT;
+            break;
+        }
+        {
+            store_released released;
+            usleep(wait_ms * 1000);
+        }
+        wait_ms = min(wait_ms * 2, (useconds_t) LOCK_POLL_MAX_MS);
+        returnCode = ticket_call("pollrange", ticket);
+    }
+
+    if (returnCode < 0) {
+        DLOG("Could not lock range of '%s': %d", path, returnCode);
+    }
+    return returnCode;
+}
+
+int unlock_range(void *userdata, const char *path, off_t offset, off_t len, rw_lock_mode_t mode) {
+    struct files_store *user = (struct files_store *) userdata;
+    uint64_t owner = user->session_id;
+
     // SET UP THE RPC CALL
-    DLOG("unlock called for '%s'", path);
-    
-    int ARG_COUNT = 3;
+    DLOG("unlock_range called for '%s' [%ld, +%ld)", path, (long) offset, (long) len);
+
+    int ARG_COUNT = 6;
 
     void **args = new void*[ARG_COUNT];
 
@@ -101,21 +242,30 @@ int unlock(const char *path, rw_lock_mode_t mode) {
         (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
     args[0] = (void *) path;
 
-    arg_types[1] = (1u << ARG_INPUT) |  (ARG_INT << 16u);
-    args[1] = (void *) &mode;
+    arg_types[1] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[1] = (void *) &offset;
+
+    arg_types[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[2] = (void *) &len;
+
+    arg_types[3] = (1u << ARG_INPUT) |  (ARG_INT << 16u);
+    args[3] = (void *) &mode;
 
-    arg_types[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    arg_types[4] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    args[4] = (void *) &owner;
+
+    arg_types[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
     int returnCode = 0;
-    args[2] = (void *) &returnCode;
+    args[5] = (void *) &returnCode;
 
-    arg_types[3] = 0;
+    arg_types[6] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"unlock", arg_types, args);
+    int rpc_ret = rpc_call_unlocked("unlockrange", arg_types, args);
 
     int fxn_ret = 0;
     if (rpc_ret < 0) {
-        DLOG("lock rpc failed with error '%d'", rpc_ret);
+        DLOG("unlockrange rpc failed with error '%d'", rpc_ret);
         fxn_ret = -EINVAL;
     } else {
         fxn_ret = returnCode;
@@ -128,6 +278,213 @@ int unlock(const char *path, rw_lock_mode_t mode) {
     return fxn_ret;
 }
 
+// Lock the whole file.
+int lock(void *userdata, const char *path, rw_lock_mode_t mode) {
+    return lock_range(userdata, path, 0, RANGE_EOF, mode);
+}
+
+int unlock(void *userdata, const char *path, rw_lock_mode_t mode) {
+    return unlock_range(userdata, path, 0, RANGE_EOF, mode);
+}
+
+// Lock each range start -> end of path in mode, in ascending order so two
+// clients locking overlapping sets can't deadlock. An end of RANGE_EOF runs
+// to the end of the file. On failure nothing is left locked.
+int lock_ranges(void *userdata, const char *path, const map<off_t, off_t> &ranges, rw_lock_mode_t mode) {
+    for (auto it = ranges.begin(); it != ranges.end(); it++) {
+        off_t len = it->second == RANGE_EOF ? RANGE_EOF : it->second - it->first;
+        int returnCode = lock_range(userdata, path, it->first, len, mode);
+        if (returnCode < 0) {
+            unlock_ranges(userdata, path, map<off_t, off_t>(ranges.begin(), it), mode);
+            return returnCode;
+        }
+    }
+    return 0;
+}
+
+// Unlock every range, even after one fails. Returns the first error, e.g.
+// -EPERM for a range the server reaped after its lease ran out.
+int unlock_ranges(void *userdata, const char *path, const map<off_t, off_t> &ranges, rw_lock_mode_t mode) {
+    int fxn_ret = 0;
+    for (auto it = ranges.begin(); it != ranges.end(); it++) {
+        off_t len = it->second == RANGE_EOF ? RANGE_EOF : it->second - it->first;
+        int returnCode = unlock_range(userdata, path, it->first, len, mode);
+        if (returnCode < 0 && fxn_ret == 0) {
+            fxn_ret = returnCode;
+        }
+    }
+    return fxn_ret;
+}
+
+// The ranges an upload changes at the server: every dirty range, and
+// everything from tail on, where bytes are cut off or zero filled by the
+// truncates. Many small ranges are locked as one span instead.
+map<off_t, off_t> upload_lock_ranges(const map<off_t, off_t> &dirty, off_t tail) {
+    map<off_t, off_t> ranges;
+    for (auto it = dirty.begin(); it != dirty.end() && it->first < tail; it++) {
+        ranges[it->first] = min(it->second, tail);
+    }
+
+    if (ranges.size() >= MAX_UPLOAD_LOCKS) {
+        tail = ranges.begin()->first;
+        ranges.clear();
+    }
+    // a dirty range ending right at tail runs into it
+    if (!ranges.empty() && ranges.rbegin()->second == tail) {
+        tail = ranges.rbegin()->first;
+        ranges.erase(prev(ranges.end()));
+    }
+    ranges[tail] = RANGE_EOF;
+    return ranges;
+}
+
+// Fetch the bytes [offset, offset + len) from the server and write them into
+// the local copy at the same offset. Data moves through one buffer of at most
+// TRANSFER_WINDOW bytes, so memory use does not depend on len.
+int fetch_range_from_server(void *userdata, const char *path, int fd, off_t offset,
+                            size_t len, struct fuse_file_info *fi) {
+    size_t window = min(len, (size_t) TRANSFER_WINDOW);
+    char *buf = (char *) malloc(window);
+
+    while (len > 0) {
+        size_t chunk = min(len, window);
+        int returnCode = rpc_read(userdata, path, buf, chunk, offset, fi);
+
+        if (returnCode < 0) {
+            DLOG("Fetch: Could not read range from server");
+            free(buf);
+            return returnCode;
+        }
+
+        // a short write, e.g. on a full disk, would leave a hole in a copy
+        // the caller records as current
+        int written = 0;
+        while (written < returnCode) {
+            int write_response = pwrite(fd, buf + written, returnCode - written, offset + written);
+            DLOG("Fetch: Written characters: %d", write_response);
+
+            if (write_response <= 0) {
+                DLOG("Fetch: Could not write range to client");
+                free(buf);
+                return write_response < 0 ? -errno : -EIO;
+            }
+            written += write_response;
+        }
+
+        // the file at the server ended early
+        if ((size_t) returnCode < chunk) {
+            break;
+        }
+
+        offset += chunk;
+        len -= chunk;
+    }
+
+    free(buf);
+    return 0;
+}
+
+// Compare the checksum of every block of the server's copy with the local
+// copy open at fd and pull only the blocks that differ. Runs of adjacent
+// changed blocks are fetched together. If the server can not hash the file the
+// whole file is fetched. cached_hashes are the known checksums of the local
+// copy (from the cache index) and save hashing it again; the server's
+// checksums are returned in server_hashes, or left empty if not all known.
+int sync_blocks_from_server(void *userdata, const char *path, int fd, off_t size,
+                            struct fuse_file_info *fi, const vector<uint64_t> &cached_hashes,
+                            vector<uint64_t> &server_hashes) {
+    struct stat local;
+    if (fstat(fd, &local) < 0) {
+        DLOG("Sync: Could not stat local copy");
+        return -errno;
+    }
+
+    int fxn_ret = 0;
+    off_t num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t *hashes = new uint64_t[CHECKSUMS_PER_CALL];
+    char *block = (char *) malloc(BLOCK_SIZE);
+
+    // first block of the current run of changed blocks, -1 if none
+    off_t run_start = -1;
+    off_t changed_blocks = 0;
+
+    for (off_t first = 0; first < num_blocks && fxn_ret == 0; first += CHECKSUMS_PER_CALL) {
+        size_t count = CHECKSUMS_PER_CALL;
+        if ((off_t) count > num_blocks - first) {
+            count = num_blocks - first;
+        }
+
+        // nothing is cached yet, so every block differs
+        int num_hashes = 0;
+        if (local.st_size > 0) {
+            num_hashes = rpc_checksums(userdata, path, hashes, count, first);
+            if (num_hashes < 0) {
+                DLOG("Sync: Server could not hash file, fetching all blocks");
+                num_hashes = 0;
+            }
+            server_hashes.insert(server_hashes.end(), hashes, hashes + num_hashes);
+        }
+
+        for (size_t i = 0; i < count && fxn_ret == 0; i++) {
+            off_t block_num = first + i;
+            off_t block_offset = block_num * BLOCK_SIZE;
+            size_t block_len = BLOCK_SIZE;
+            if (size - block_offset < BLOCK_SIZE) {
+                block_len = size - block_offset;
+            }
+
+            bool changed = true;
+            if ((int) i < num_hashes && block_offset + (off_t) block_len <= local.st_size) {
+                // a full length block can reuse its indexed checksum, the
+                // last block may have been cut short so is always re-hashed
+                if (block_num < (off_t) cached_hashes.size() &&
+                    block_offset + BLOCK_SIZE <= local.st_size && block_len == BLOCK_SIZE) {
+                    changed = cached_hashes[block_num] != hashes[i];
+                }
+                else {
+                    int bytes_read = pread(fd, block, block_len, block_offset);
+                    changed = bytes_read != (int) block_len ||
+                              block_checksum(block, block_len) != hashes[i];
+                }
+            }
+
+            if (changed) {
+                changed_blocks += 1;
+                if (run_start < 0) {
+                    run_start = block_num;
+                }
+            }
+            else if (run_start >= 0) {
+                fxn_ret = fetch_range_from_server(userdata, path, fd, run_start * BLOCK_SIZE,
+                                                  (block_num - run_start) * BLOCK_SIZE, fi);
+                run_start = -1;
+            }
+        }
+    }
+
+    if (fxn_ret == 0 && run_start >= 0) {
+        fxn_ret = fetch_range_from_server(userdata, path, fd, run_start * BLOCK_SIZE,
+                                          size - run_start * BLOCK_SIZE, fi);
+    }
+
+    DLOG("Sync: %ld of %ld blocks fetched", (long) changed_blocks, (long) num_blocks);
+
+    if ((off_t) server_hashes.size() != num_blocks) {
+        server_hashes.clear();
+    }
+
+    // drop anything past the end of the server's copy
+    if (fxn_ret == 0 && ftruncate(fd, size) < 0) {
+        DLOG("Sync: Could not truncate local copy");
+        fxn_ret = -errno;
+    }
+
+    free(block);
+    delete []hashes;
+
+    return fxn_ret;
+}
+
 int download_from_server_to_client(void *userdata, char *full_path, const char *path) {
     DLOG("Downloading from server to client");
 
@@ -136,20 +493,49 @@ int download_from_server_to_client(void *userdata, char *full_path, const char *
     int fd = 0;
 
     // lock file - read mode
-    lock(path, RW_READ_LOCK);
+    returnCode = lock(userdata, path, RW_READ_LOCK);
+    if (returnCode < 0) {
+        DLOG("Download: Could not lock file at server");
+        return returnCode;
+    }
 
-    // get attr of file
+    // get attr of file, from the server itself so the copy gets the size
+    // and time of the version that is locked
     struct stat *statbuf = new struct stat;
-    returnCode = rpc_getattr(userdata, path, statbuf);
+    returnCode = fetch_server_attr(userdata, path, statbuf);
 
     if (returnCode < 0) {
         DLOG("Download: File does not exist at the server");
+        delete statbuf;
+        unlock(userdata, path, RW_READ_LOCK);
         return returnCode;
     }
 
+    // If the cached copy is the version the cache index recorded, and the
+    // server still has that version, there is nothing to transfer.
+    struct files_store *user = (struct files_store *) userdata;
+    struct cache_entry *entry = find_cache_entry(user, path);
+    if (entry != nullptr && is_cache_entry_current(entry, statbuf)) {
+        DLOG("Download: Cached copy is current");
+        touch_cache_entry(user, entry);
+        if (file_already_open(userdata, full_path)) {
+            record_version(&user->cur_open_files[full_path], statbuf);
+        }
+        if (!holds_lease(userdata, path)) {
+            acquire_lease(userdata, path, statbuf);
+        }
+        delete statbuf;
+        unlock(userdata, path, RW_READ_LOCK);
+        return 0;
+    }
+
+    vector<uint64_t> cached_hashes;
+    if (entry != nullptr) {
+        cached_hashes = entry->checksums;
+    }
+
     struct fuse_file_info *fi = new struct fuse_file_info;
     fi->flags = O_RDONLY;
-    struct files_store *user = (struct files_store *) userdata;
     if (!file_already_open(userdata, full_path)) {
         // open file
         fd = open(full_path, O_RDWR);
@@ -170,7 +556,7 @@ int download_from_server_to_client(void *userdata, char *full_path, const char *
             DLOG("Download: Could not open file at server. Exiting...");
             delete fi;
             delete statbuf;
-            unlock(path, RW_READ_LOCK);
+            unlock(userdata, path, RW_READ_LOCK);
             return returnCode;
         }
     }
@@ -179,35 +565,20 @@ int download_from_server_to_client(void *userdata, char *full_path, const char *
         fi->fh = user->cur_open_files[full_path].server_fi;
     }
 
-    // read file from server
-    // 2. Read file from server
-    size_t size = statbuf->st_size;
-    char *buf = (char *) malloc(((off_t) size) * sizeof(char));
-    returnCode = rpc_read(userdata, path, buf, size, 0, fi);
+    // 2. Bring the local copy in line with the server, fetching only the
+    // blocks that differ from what is already cached
+    vector<uint64_t> server_hashes;
+    returnCode = sync_blocks_from_server(userdata, path, fd, statbuf->st_size, fi,
+                                         cached_hashes, server_hashes);
 
     if (returnCode < 0) {
-        DLOG("Download: Could not read file from server");
-        free(buf);
+        DLOG("Download: Could not sync file contents from server");
         delete statbuf;
         delete fi;
-        unlock(path, RW_READ_LOCK);
+        unlock(userdata, path, RW_READ_LOCK);
         return returnCode;
     }
 
-    // write the file contents to client
-    int write_response = 0;
-    write_response = pwrite(fd, buf, size, 0);
-    DLOG("Written characters: %d", write_response);
-
-    if (write_response < 0) {
-        DLOG("Download: Could not write file contents to client");
-        free(buf);
-        delete statbuf;
-        delete fi;
-        unlock(path, RW_READ_LOCK);
-        return -errno;
-    }
-
     // update file metadata at client
     struct timespec ts[2];
     ts[0] = (struct timespec) (statbuf->st_mtim);
@@ -217,13 +588,20 @@ int download_from_server_to_client(void *userdata, char *full_path, const char *
     
     if (returnCode < 0) {
         DLOG("Download: Could not update file metadata at client");
-        free(buf);
         delete statbuf;
         delete fi;
-        unlock(path, RW_READ_LOCK);
+        unlock(userdata, path, RW_READ_LOCK);
         return -errno;
     }
 
+    // the cached copy now holds this version of the file
+    record_cache_entry(user, path, statbuf, server_hashes);
+    if (file_already_open(userdata, full_path)) {
+        record_version(&user->cur_open_files[full_path], statbuf);
+    }
+    evict_cache_entries(user, path);
+    acquire_lease(userdata, path, statbuf);
+
     if (!file_already_open(userdata, full_path)) {
         // release file
         returnCode = rpc_release(userdata, path, fi);
@@ -237,23 +615,227 @@ int download_from_server_to_client(void *userdata, char *full_path, const char *
         returnCode = close(fd);
         if (returnCode < 0) {
             DLOG("Download: Could not close file at client");
-            free(buf);
             delete statbuf;
             delete fi;
-            unlock(path, RW_READ_LOCK);
+            unlock(userdata, path, RW_READ_LOCK);
             return -errno;
         }
     }
 
-    free(buf);
     delete statbuf;
     delete fi;
 
-    unlock(path, RW_READ_LOCK);
+    unlock(userdata, path, RW_READ_LOCK);
 
     return fxn_ret;
 }
 
+// Download a file that is already open at the server, releasing the open if
+// that fails.
+static int download_opened(void *userdata, char *full_path, const char *path,
+                           struct fuse_file_info *fi, struct stat *server_stat) {
+    int returnCode = download_from_server_to_client(userdata, full_path, path);
+    if (returnCode == 0) {
+        // the download cached the attributes it fetched under its lock
+        returnCode = get_server_attr(userdata, path, server_stat);
+    }
+    if (returnCode < 0) {
+        DLOG("Open Fetch: Download failed");
+        rpc_release(userdata, path, fi);
+    }
+    return returnCode;
+}
+
+// Open path at the server for fi->flags and bring the cached copy up to date,
+// starting with one openfetch rpc. A file no longer than OPEN_FETCH_SIZE
+// arrives with it, so opening it costs a single round trip. Larger files are
+// downloaded as usual. On success fi->fh is open at the server and
+// server_stat holds the version the cached copy matches.
+int open_from_server(void *userdata, char *full_path, const char *path,
+                     struct fuse_file_info *fi, struct stat *server_stat) {
+    struct files_store *user = (struct files_store *) userdata;
+    char *buf = (char *) malloc(OPEN_FETCH_SIZE);
+
+    int returnCode = rpc_openfetch(userdata, path, fi, server_stat, buf, OPEN_FETCH_SIZE);
+    if (returnCode == -EAGAIN) {
+        // someone holds a write range of the file, open it without the head
+        // and let the download queue for the lock
+        DLOG("Open Fetch: File is locked, opening it plainly");
+        free(buf);
+        returnCode = rpc_open(userdata, path, fi);
+        if (returnCode < 0) {
+            DLOG("Open Fetch: Could not open file at server");
+            return returnCode;
+        }
+        return download_opened(userdata, full_path, path, fi, server_stat);
+    }
+    if (returnCode < 0) {
+        DLOG("Open Fetch: Could not open file at server");
+        free(buf);
+        return returnCode;
+    }
+    store_server_attr(userdata, path, server_stat);
+
+    struct cache_entry *entry = find_cache_entry(user, path);
+    if (entry != nullptr && is_cache_entry_current(entry, server_stat)) {
+        DLOG("Open Fetch: Cached copy is current");
+        touch_cache_entry(user, entry);
+        if (!holds_lease(userdata, path)) {
+            acquire_lease(userdata, path, server_stat);
+        }
+        free(buf);
+        return 0;
+    }
+
+    if (server_stat->st_size > returnCode) {
+        // The head isn't the whole file. Put it in the cached copy anyway, the
+        // block sync then finds those blocks matching and fetches the rest.
+        // The copy no longer matches its entry, so its checksums are hashed
+        // again from the file.
+        forget_cache_entry(user, path);
+        int fd = open(full_path, O_RDWR | O_CREAT, server_stat->st_mode & 0777);
+        if (fd < 0 || pwrite(fd, buf, returnCode, 0) != returnCode) {
+            DLOG("Open Fetch: Could not keep the head, downloading all of it");
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(buf);
+        return download_opened(userdata, full_path, path, fi, server_stat);
+    }
+
+    // the whole file came back with the open, write it into the cache
+    vector<uint64_t> hashes;
+    int fd = open(full_path, O_RDWR | O_CREAT, server_stat->st_mode & 0777);
+    int fxn_ret = 0;
+    if (fd < 0 || pwrite(fd, buf, returnCode, 0) != returnCode || ftruncate(fd, returnCode) < 0) {
+        DLOG("Open Fetch: Could not write file to client");
+        fxn_ret = -errno;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    for (off_t offset = 0; offset < returnCode; offset += BLOCK_SIZE) {
+        hashes.push_back(block_checksum(buf + offset, min((off_t) BLOCK_SIZE, returnCode - offset)));
+    }
+    free(buf);
+
+    // update file metadata at client
+    struct timespec ts[2];
+    ts[0] = (struct timespec) (server_stat->st_mtim);
+    ts[1] = (struct timespec) (server_stat->st_mtim);
+    if (fxn_ret == 0 && utimensat(0, full_path, ts, 0) < 0) {
+        DLOG("Open Fetch: Could not update file metadata at client");
+        fxn_ret = -errno;
+    }
+
+    if (fxn_ret < 0) {
+        rpc_release(userdata, path, fi);
+        return fxn_ret;
+    }
+
+    // the cached copy now holds this version of the file
+    record_cache_entry(user, path, server_stat, hashes);
+    evict_cache_entries(user, path);
+    acquire_lease(userdata, path, server_stat);
+
+    return 0;
+}
+
+// Bring an open file up to date with the server after a failed freshness
+// check. Sparse copies only forget their fetched blocks, other copies are
+// downloaded.
+int refresh_open_file(void *userdata, char *full_path, const char *path) {
+    struct files_store *user = (struct files_store *) userdata;
+    struct file_info *file = &user->cur_open_files[full_path];
+
+    if (user->sparse_files) {
+        return reset_sparse_copy(userdata, path, file);
+    }
+
+    return download_from_server_to_client(userdata, full_path, path);
+}
+
+// Record that [offset, offset + len) of an open file was written locally.
+// Overlapping and adjacent ranges are merged, so dirty always holds disjoint
+// ranges in offset order.
+void mark_dirty(struct file_info *file, off_t offset, size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    off_t start = offset;
+    off_t end = offset + len;
+
+    // the first range that could touch [start, end) is the one before it
+    auto it = file->dirty.upper_bound(start);
+    if (it != file->dirty.begin() && prev(it)->second >= start) {
+        it = prev(it);
+    }
+
+    while (it != file->dirty.end() && it->first <= end) {
+        start = min(start, it->first);
+        end = max(end, it->second);
+        it = file->dirty.erase(it);
+    }
+
+    file->dirty[start] = end;
+}
+
+// Record that an open file was truncated to size locally. Dirty ranges past
+// the new end of the file are dropped.
+void truncate_dirty(struct file_info *file, off_t size) {
+    auto it = file->dirty.lower_bound(size);
+    file->dirty.erase(it, file->dirty.end());
+
+    if (!file->dirty.empty() && file->dirty.rbegin()->second > size) {
+        file->dirty.rbegin()->second = size;
+    }
+
+    if (file->truncated_to < 0 || size < file->truncated_to) {
+        file->truncated_to = size;
+    }
+}
+
+// Write the bytes [offset, offset + len) of the local copy open at fh to the
+// server, TRANSFER_WINDOW bytes at a time.
+int push_range_to_server(void *userdata, const char *path, int fh, off_t offset,
+                         size_t len, struct fuse_file_info *fi) {
+    size_t window = min(len, (size_t) TRANSFER_WINDOW);
+    char *buf = (char *) malloc(window);
+
+    while (len > 0) {
+        size_t chunk = min(len, window);
+        int returnCode = pread(fh, buf, chunk, offset);
+
+        if (returnCode < 0) {
+            DLOG("Push: Could not read range at client");
+            free(buf);
+            return -errno;
+        }
+
+        // the local copy ended early
+        if (returnCode == 0) {
+            break;
+        }
+
+        returnCode = rpc_write(userdata, path, buf, returnCode, offset, fi);
+
+        if (returnCode <= 0) {
+            DLOG("Push: Could not write range to server");
+            free(buf);
+            return returnCode < 0 ? returnCode : -EIO;
+        }
+
+        offset += returnCode;
+        len -= returnCode;
+    }
+
+    free(buf);
+    return 0;
+}
+
 int upload_from_client_to_server(void *userdata, char *full_path, const char *path) {
 
     DLOG("Uploading from client to server");
@@ -261,8 +843,8 @@ int upload_from_client_to_server(void *userdata, char *full_path, const char *pa
     int fxn_ret = 0;
     int returnCode = 0;
 
-    // aquire lock - write mode
-    lock(path, RW_WRITE_LOCK);
+    // the server copy is about to change
+    invalidate_server_attr(userdata, path);
 
     // get attr of file at client
     struct stat *statbuf = new struct stat;
@@ -271,14 +853,21 @@ int upload_from_client_to_server(void *userdata, char *full_path, const char *pa
     if (returnCode < 0) {
         DLOG("Upload: Could not get file metadata at client");
         delete statbuf;
-        unlock(path, RW_WRITE_LOCK);
         return -errno;
     }
 
     int fh = 0;
     struct fuse_file_info *fi = new struct fuse_file_info;
     struct files_store *user = (struct files_store *) userdata;
-    if (!file_already_open(userdata, full_path)) {
+
+    // Only the ranges written since the last upload need to be sent. A file
+    // that isn't open was just downloaded by the caller, so only its size and
+    // times can differ from the server.
+    map<off_t, off_t> dirty;
+    off_t truncated_to = -1;
+
+    bool already_open = file_already_open(userdata, full_path);
+    if (!already_open) {
         // open file at server
         fi->flags = O_RDWR;
         returnCode = rpc_open(userdata, path, fi);
@@ -293,7 +882,6 @@ int upload_from_client_to_server(void *userdata, char *full_path, const char *pa
                 DLOG("Upload: Could not create file at server");
                 delete statbuf;
                 delete fi;
-                unlock(path, RW_WRITE_LOCK);
                 return returnCode;
             }
             returnCode = rpc_open(userdata, path, fi);
@@ -301,9 +889,11 @@ int upload_from_client_to_server(void *userdata, char *full_path, const char *pa
                 DLOG("Upload: Could not open file at server");
                 delete statbuf;
                 delete fi;
-                unlock(path, RW_WRITE_LOCK);
                 return returnCode;
             }
+
+            // the new file at the server is empty, so send everything
+            dirty[0] = statbuf->st_size;
         }
 
         // open file at client
@@ -312,109 +902,158 @@ int upload_from_client_to_server(void *userdata, char *full_path, const char *pa
 
         if (fh < 0) {
             DLOG("Upload: Could not open file at client");
+            rpc_release(userdata, path, fi);
             delete statbuf;
             delete fi;
-            unlock(path, RW_WRITE_LOCK);
             return -errno;
         }
 
     }
     else {
         // file is already open
-        fh = user->cur_open_files[full_path].client_fi;
-        returnCode = user->cur_open_files[full_path].server_fi;
+        struct file_info &open_file = user->cur_open_files[full_path];
+        fh = open_file.client_fi;
+        fi->fh = open_file.server_fi;
+        dirty = open_file.dirty;
+        truncated_to = open_file.truncated_to;
     }
-    
 
-    // read file at client
-    std::cout << "File Handle Here: " << fh << std::endl;
-    size_t size = statbuf->st_size;
-    char *buf = (char *) malloc(((off_t) size) * sizeof(char));
-    returnCode = pread(fh, buf, size, 0);
+    off_t size = statbuf->st_size;
 
-    if (returnCode < 0) {
-        DLOG("Upload: Could not read file at client");
-        free(buf);
-        delete statbuf;
-        delete fi;
-        unlock(path, RW_WRITE_LOCK);
-        return -errno;
+    // write lock only what changes at the server, readers of the rest of the
+    // file carry on during the transfer
+    off_t tail = size;
+    if (truncated_to >= 0 && truncated_to < size) {
+        tail = truncated_to;
+    }
+    map<off_t, off_t> locked = upload_lock_ranges(dirty, tail);
+    fxn_ret = lock_ranges(userdata, path, locked, RW_WRITE_LOCK);
+    if (fxn_ret < 0) {
+        locked.clear();
     }
 
-    // truncate file at server
-    returnCode = rpc_truncate(userdata, path, 0);
-    if (returnCode < 0) {
-        DLOG("Upload: Could not truncate file at server");
-        free(buf);
-        delete statbuf;
-        delete fi;
-        unlock(path, RW_WRITE_LOCK);
-        return returnCode;
+    // If the file was shrunk since the last upload, cut the server copy down
+    // first so stale bytes don't survive between the old and new end of file.
+    if (fxn_ret == 0 && truncated_to >= 0 && truncated_to < size) {
+        returnCode = rpc_truncate(userdata, path, truncated_to);
+        if (returnCode < 0) {
+            DLOG("Upload: Could not truncate file at server");
+            fxn_ret = returnCode;
+        }
     }
 
-    // write file to server
-    fi->fh = user->cur_open_files[full_path].server_fi;
-    returnCode = rpc_write(userdata, path, buf, (off_t) size, 0, fi);
-    if (returnCode < 0) {
-        DLOG("Upload: Could not write to file at server");
-        free(buf);
-        delete statbuf;
-        delete fi;
-        unlock(path, RW_WRITE_LOCK);
-        return returnCode;
+    // set the final size at server
+    if (fxn_ret == 0) {
+        returnCode = rpc_truncate(userdata, path, size);
+        if (returnCode < 0) {
+            DLOG("Upload: Could not truncate file at server");
+            fxn_ret = returnCode;
+        }
+    }
+
+    // write the dirty ranges to the server
+    off_t bytes_pushed = 0;
+    for (auto it = dirty.begin(); it != dirty.end() && fxn_ret == 0; it++) {
+        off_t start = it->first;
+        off_t end = min(it->second, size);
+        if (start >= end) {
+            continue;
+        }
+
+        returnCode = push_range_to_server(userdata, path, fh, start, end - start, fi);
+        if (returnCode < 0) {
+            DLOG("Upload: Could not write to file at server");
+            fxn_ret = returnCode;
+        }
+        bytes_pushed += end - start;
     }
+    DLOG("Upload: Pushed %ld of %ld bytes", (long) bytes_pushed, (long) size);
 
     // update metadata
-    struct timespec ts[2];
-    ts[0] = (struct timespec) statbuf->st_mtim;
-    ts[1] = (struct timespec) statbuf->st_mtim;
-    returnCode = rpc_utimensat(userdata, path, ts);
+    if (fxn_ret == 0) {
+        struct timespec ts[2];
+        ts[0] = (struct timespec) statbuf->st_mtim;
+        ts[1] = (struct timespec) statbuf->st_mtim;
+        returnCode = rpc_utimensat(userdata, path, ts);
 
-    if (returnCode < 0) {
-        DLOG("Upload: Could not write to update timestamp at server");
-        free(buf);
-        delete statbuf;
-        delete fi;
-        unlock(path, RW_WRITE_LOCK);
-        return returnCode;
+        if (returnCode < 0) {
+            DLOG("Upload: Could not write to update timestamp at server");
+            fxn_ret = returnCode;
+        }
+    }
+
+    // release lock. The server refuses if it reaped a range whose lease ran
+    // out mid upload, another writer may then have come in between, so the
+    // upload fails and is retried.
+    returnCode = unlock_ranges(userdata, path, locked, RW_WRITE_LOCK);
+    if (returnCode < 0 && fxn_ret == 0) {
+        DLOG("Upload: Lost the lock of the server copy");
+        fxn_ret = returnCode;
     }
 
+    if (fxn_ret == 0) {
+        if (already_open && !user->cur_open_files[full_path].present.empty()) {
+            // a sparse copy still misses blocks that were never fetched, so
+            // it can't be trusted as a whole version on the next open
+            forget_cache_entry(user, path);
+        }
+        else {
+            // the server now has the cached copy's contents and times
+            record_cache_entry(user, path, statbuf, vector<uint64_t>());
+            evict_cache_entries(user, path);
+        }
+    }
 
-    if (!file_already_open(userdata, full_path)) {
+    if (!already_open) {
         // close file local
         returnCode = close(fh);
 
-        if (returnCode < 0) {
+        if (returnCode < 0 && fxn_ret == 0) {
             DLOG("Upload: Could not close file at client");
-            free(buf);
-            delete statbuf;
-            delete fi;
-            unlock(path, RW_WRITE_LOCK);
-            return -errno;
+            fxn_ret = -errno;
         }
 
         // release file server
         returnCode = rpc_release(userdata, path, fi);
 
-        if (returnCode < 0) {
+        if (returnCode < 0 && fxn_ret == 0) {
             DLOG("Upload: Could not release file at server");
-            free(buf);
-            delete statbuf;
-            delete fi;
-            unlock(path, RW_WRITE_LOCK);
-            return returnCode;
+            fxn_ret = returnCode;
         }
     }
-    
-    free(buf);
+    else if (fxn_ret == 0) {
+        // the server is now up to date, keep the ranges on failure so the
+        // next upload retries them
+        struct file_info &open_file = user->cur_open_files[full_path];
+        open_file.dirty.clear();
+        open_file.truncated_to = -1;
+        open_file.version_known = false;
+    }
+
     delete statbuf;
     delete fi;
-    // release lock
-    unlock(path, RW_WRITE_LOCK);
 
     return fxn_ret;
 }
 
+static bool same_time(const struct timespec &a, const struct timespec &b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+void record_version(struct file_info *file, const struct stat *server_stat) {
+    file->version.mtime = server_stat->st_mtim;
+    file->version.ctime = server_stat->st_ctim;
+    file->version.size = server_stat->st_size;
+    file->version.ino = server_stat->st_ino;
+    file->version_known = true;
+}
+
+bool same_version(const struct file_version *version, const struct stat *server_stat) {
+    return same_time(version->mtime, server_stat->st_mtim) &&
+           same_time(version->ctime, server_stat->st_ctim) &&
+           version->size == server_stat->st_size && version->ino == server_stat->st_ino;
+}
+
 bool is_file_fresh(void *userdata, char *full_path, const char *path) {
     DLOG("Checking freshness of file at client");
 
@@ -423,7 +1062,14 @@ bool is_file_fresh(void *userdata, char *full_path, const char *path) {
     // retrieve file meta data
     struct files_store *user = (struct files_store *) userdata;
     time_t t = user->cache_interval;
-    struct file_info client_file = user->cur_open_files[full_path];
+    struct file_info &client_file = user->cur_open_files[full_path];
+
+    // In write-back mode the copy of a file open for writing is the newest
+    // version, the server only catches up when it is flushed. No other client
+    // can write it meanwhile.
+    if (user->write_back && get_access_mode(client_file.flags) != O_RDONLY) {
+        return true;
+    }
 
      // check if time since last cache validation is within cache interval
     time_t tc = client_file.tc;
@@ -433,6 +1079,13 @@ bool is_file_fresh(void *userdata, char *full_path, const char *path) {
         return true;
     }
 
+    // a read-only copy stays valid until the server revokes the lease
+    if (get_access_mode(client_file.flags) == O_RDONLY && holds_lease(userdata, path)) {
+        DLOG("Freshness: Lease held");
+        user->cur_open_files[full_path].tc = current_time;
+        return true;
+    }
+
     // get files attributes at client
     struct stat *statbuf_client = new struct stat;
     returnCode = stat(full_path, statbuf_client);
@@ -443,9 +1096,9 @@ bool is_file_fresh(void *userdata, char *full_path, const char *path) {
         return false;
     }
 
-    // fetch file attributes from server
+    // fetch file attributes from server, a cached entry may predate a change
     struct stat *statbuf_server = new struct stat;
-    returnCode = rpc_getattr(userdata, path, statbuf_server);
+    returnCode = fetch_server_attr(userdata, path, statbuf_server);
 
     if (returnCode < 0) {
         DLOG("Freshness: Could not retrieve file attr from server");
@@ -454,12 +1107,24 @@ bool is_file_fresh(void *userdata, char *full_path, const char *path) {
         return returnCode;
     }
 
-    // check if client time and server time are equal
-    time_t T_client = statbuf_client->st_mtime;
-    time_t T_server = statbuf_server->st_mtime;
-    if (T_client == T_server) {
+    // The server must still have the version the copy was synced with, and
+    // T_client must equal T_server to the nanosecond, otherwise the copy
+    // changed locally. Right after an upload only the times are compared and
+    // the server's version is adopted.
+    bool is_fresh = same_time(statbuf_client->st_mtim, statbuf_server->st_mtim);
+    if (is_fresh && client_file.version_known) {
+        is_fresh = same_version(&client_file.version, statbuf_server);
+    }
+
+    if (is_fresh) {
         // update tc to current time
-        user->cur_open_files[full_path].tc = current_time;
+        client_file.tc = current_time;
+        if (!client_file.version_known) {
+            record_version(&client_file, statbuf_server);
+        }
+        if (get_access_mode(client_file.flags) == O_RDONLY) {
+            acquire_lease(userdata, path, statbuf_server);
+        }
         delete statbuf_client;
         delete statbuf_server;
         return true;
@@ -491,6 +1156,13 @@ int update_TServer_to_TClient(void *userdata, char *full_path, const char *path)
     ts[0] = (struct timespec) statbuf_client->st_mtim;
     ts[1] = (struct timespec) statbuf_client->st_mtim;
     returnCode = rpc_utimensat(userdata, path, ts);
+    invalidate_server_attr(userdata, path);
+
+    // setting the times gives the server file a new version
+    struct files_store *user = (struct files_store *) userdata;
+    if (file_already_open(userdata, full_path)) {
+        user->cur_open_files[full_path].version_known = false;
+    }
 
     if (returnCode < 0) {
         DLOG("Update Server Time: Could not set file attr at server");
@@ -509,9 +1181,9 @@ int update_TClient_to_TServer(void *userdata, char *full_path, const char *path)
 
     int returnCode = 0;
 
-    // get files attributes at server
+    // get files attributes at server, cached by the download just before
     struct stat *statbuf_server = new struct stat;
-    returnCode = rpc_getattr(userdata, path, statbuf_server);
+    returnCode = get_server_attr(userdata, path, statbuf_server);
 
     if (returnCode < 0) {
         DLOG("Update Client Time: Could not retrieve file attr at server");
@@ -1,19 +1,75 @@
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <vector>
 #include "rw_lock.h"
 
+// Largest buffer used to move file data between the client and the server.
+// Transfers of any size are streamed through a window of this many bytes.
+#define TRANSFER_WINDOW (4 * 1024 * 1024)
+
+// Bytes of a file returned with the openfetch rpc that opens it. Files no
+// larger than this are opened and downloaded in a single round trip.
+#define OPEN_FETCH_SIZE 32768
+
+// Most separate ranges an upload write locks, more are locked as one span
+// from the first to the end of the file.
+#define MAX_UPLOAD_LOCKS 8
+
+struct fuse_file_info;
+struct file_info;
+struct file_version;
+struct stat;
+
 char *get_full_path(const char *short_path, void *userdata);
 
+int make_cache_dirs(void *userdata, const char *full_path);
+
+long get_config(const char *name, long default_value);
+
 int get_access_mode(int flag);
 
 bool file_already_open(void *userdata, char *full_path);
 
-int lock(const char *path, rw_lock_mode_t mode);
+// Whether full_path, or anything below it if it is a directory, is open.
+bool tree_already_open(void *userdata, char *full_path);
+
+int lock_range(void *userdata, const char *path, off_t offset, off_t len, rw_lock_mode_t mode);
+
+int unlock_range(void *userdata, const char *path, off_t offset, off_t len, rw_lock_mode_t mode);
+
+int lock(void *userdata, const char *path, rw_lock_mode_t mode);
+
+int unlock(void *userdata, const char *path, rw_lock_mode_t mode);
+
+int lock_ranges(void *userdata, const char *path, const std::map<off_t, off_t> &ranges, rw_lock_mode_t mode);
 
-int unlock(const char *path, rw_lock_mode_t mode);
+int unlock_ranges(void *userdata, const char *path, const std::map<off_t, off_t> &ranges, rw_lock_mode_t mode);
+
+std::map<off_t, off_t> upload_lock_ranges(const std::map<off_t, off_t> &dirty, off_t tail);
+
+int fetch_range_from_server(void *userdata, const char *path, int fd, off_t offset, size_t len, struct fuse_file_info *fi);
+
+int sync_blocks_from_server(void *userdata, const char *path, int fd, off_t size, struct fuse_file_info *fi, const std::vector<uint64_t> &cached_hashes, std::vector<uint64_t> &server_hashes);
 
 int download_from_server_to_client(void *userdata, char *full_path, const char *path);
 
+int open_from_server(void *userdata, char *full_path, const char *path, struct fuse_file_info *fi, struct stat *server_stat);
+
+int refresh_open_file(void *userdata, char *full_path, const char *path);
+
+void mark_dirty(struct file_info *file, off_t offset, size_t len);
+
+void truncate_dirty(struct file_info *file, off_t size);
+
+int push_range_to_server(void *userdata, const char *path, int fh, off_t offset, size_t len, struct fuse_file_info *fi);
+
 int upload_from_client_to_server(void *userdata, char *full_path, const char *path);
 
+void record_version(struct file_info *file, const struct stat *server_stat);
+
+bool same_version(const struct file_version *version, const struct stat *server_stat);
+
 bool is_file_fresh(void *userdata, char *full_path, const char *path);
 
 int update_TServer_to_TClient(void *userdata, char *full_path, const char *path);
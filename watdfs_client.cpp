@@ -12,6 +12,17 @@ INIT_LOG
 #include <map>
 #include "global.h"
 #include "utils.h"
+#include "bulk.h"
+#include "cache_index.h"
+#include "attr_cache.h"
+#include "dir_cache.h"
+#include "sparse.h"
+#include "stream.h"
+#include "writeback.h"
+#include "lock_lease.h"
+#include "session.h"
+#include "client_lock.h"
+#include "lease.h"
 #include <iostream>
 using namespace std;
 
@@ -28,7 +39,14 @@ void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
         // rpc client init failed
         DLOG("Failed to initialize RPC Client ");
     }
-    
+
+    // start the threads that keep several read/write chunks in flight
+    rpc_pool_init(get_config("WATDFS_RPC_WINDOW", RPC_WINDOW));
+
+    // connect the bulk data channel, transfers fall back to rpcs without it
+    if (rpcInitCode == 0 && get_config("WATDFS_BULK", 1) != 0) {
+        bulk_client_init();
+    }
 
     // Initialize any global state that you require for the assignment and return it.
     // The value that you return here will be passed as userdata in other functions.
@@ -39,6 +57,51 @@ void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
     char *copied_path = new char[strlen(path_to_cache) + 1];
     strcpy(copied_path, path_to_cache);
     userdata->path_to_cache = copied_path;
+
+    // everything opened or locked at the server belongs to this client's
+    // session, kept alive by heartbeats
+    if (rpcInitCode == 0) {
+        session_client_init(userdata);
+    }
+
+    // fetch blocks on demand instead of downloading whole files on open
+    userdata->sparse_files = get_config("WATDFS_SPARSE", 0) != 0;
+
+    // stream read-only opens instead of caching them
+    userdata->stream_reads = get_config("WATDFS_STREAM", 0) != 0;
+
+    // leave writes in the cache and push them from a flusher thread
+    userdata->write_back = get_config("WATDFS_WRITE_BACK", 0) != 0;
+    if (userdata->write_back) {
+        writeback_start(userdata, get_config("WATDFS_FLUSH_INTERVAL", cache_interval));
+    }
+
+    // let the server push invalidations instead of polling for changes
+    if (rpcInitCode == 0 && get_config("WATDFS_LEASES", 0) != 0) {
+        lease_client_init(userdata);
+    }
+
+    // give up on a contended range lock after lock_timeout seconds
+    userdata->lock_timeout = get_config("WATDFS_LOCK_TIMEOUT", LOCK_TIMEOUT);
+
+    // how long getattr may trust the server attributes it has seen
+    userdata->attr_ttl = get_config("WATDFS_ATTR_TTL", cache_interval);
+
+    // cap the bytes kept in the cache, least recently used copies go first
+    userdata->cache_capacity = get_config("WATDFS_CACHE_BYTES", 0);
+
+    // start warm with whatever a previous mount left in the cache
+    load_cache_index(userdata);
+
+    // and stat everything it left in a few batched rpcs rather than one
+    // getattr per path
+    if (rpcInitCode == 0 && !userdata->cache_index.empty()) {
+        vector<string> cached_paths;
+        for (auto &entry : userdata->cache_index) {
+            cached_paths.push_back(entry.first);
+        }
+        prefetch_server_attrs(userdata, cached_paths);
+    }
     
     // set `ret_code` to 0 if everything above succeeded else some appropriate
     // non-zero value.
@@ -52,9 +115,16 @@ void watdfs_cli_destroy(void *userdata) {
     // TODO for P2: clean up your userdata state.
 
     struct files_store *store = (struct files_store *) userdata;
+    writeback_stop(store);
+    lease_client_destroy(store);
+    session_client_destroy(store);
+    save_cache_index(store);
     delete store->path_to_cache;
     delete store;
 
+    bulk_client_destroy();
+    rpc_pool_destroy();
+
     // tear down the RPC library by calling `rpcClientDestroy`.
     int rpcDestroyCode = rpcClientDestroy();
 
@@ -67,6 +137,7 @@ void watdfs_cli_destroy(void *userdata) {
 
 // GET FILE ATTRIBUTES
 int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
+    client_op op(userdata, path);
 
     int returnCode = 0;
 
@@ -76,14 +147,21 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
 
     // check if file is already open
     if (!file_already_open(userdata, full_path)) {        
-        // download file from server t0 client
-        returnCode = download_from_server_to_client(userdata, full_path, path);
+        // only the attributes are needed, contents are fetched on open
+        prefetch_sibling_attrs(userdata, path);
+        returnCode = get_server_attr(userdata, path, statbuf);
         
         if (returnCode < 0) {
-            DLOG("Get Attr: Could not download from server to client");
-            free(full_path);
-            return returnCode;
+            DLOG("Get Attr: Could not retrieve file attributes from server");
         }
+        free(full_path);
+        return returnCode;
+    }
+    else if (user->cur_open_files[full_path].stream) {
+        // a streamed file has no local copy to stat
+        returnCode = get_server_attr(userdata, path, statbuf);
+        free(full_path);
+        return returnCode;
     }
     else {
         // check if open in read only mode
@@ -94,7 +172,7 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
             // if not fresh, download fresh version
             if (!is_fresh) {
                 DLOG("Get Attr: File is not fresh, fetching from server...");
-                returnCode = download_from_server_to_client(userdata, full_path, path);
+                returnCode = refresh_open_file(userdata, full_path, path);
                 if (returnCode < 0) {
                     DLOG("Get Attr: Could not fetch fresh data from the server");
                     free(full_path);
@@ -133,12 +211,16 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
 
 // CREATE, OPEN AND CLOSE
 int watdfs_cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
+    client_op op(userdata, path);
+    invalidate_server_attr(userdata, path);
+    invalidate_parent_listing(userdata, path);
     return rpc_mknod(userdata, path, mode, dev);
 }
 
 
 int watdfs_cli_open(void *userdata, const char *path,
                     struct fuse_file_info *fi) {
+    client_op op(userdata, path);
     
     // check if file is already open
     // return -EMFILE if it is
@@ -153,16 +235,55 @@ int watdfs_cli_open(void *userdata, const char *path,
     int returnCode = 0;
     int fxn_ret = 0;
 
-    // download file from server to client
-    returnCode = download_from_server_to_client(userdata, full_path, path);
+    struct files_store *user = (struct files_store *) userdata;
+    struct stat server_stat;
+
+    // read-only opens in streaming mode never touch the cache
+    if (user->stream_reads && get_access_mode(fi->flags) == O_RDONLY) {
+        // the stream stops at this size, so it must not be stale
+        returnCode = fetch_server_attr(userdata, path, &server_stat);
+        if (returnCode == 0) {
+            returnCode = rpc_open(userdata, path, fi);
+        }
+        if (returnCode < 0) {
+            DLOG("Open Error: Could not open file on server");
+            free(full_path);
+            return returnCode;
+        }
+
+        struct file_info opened_file = {-1, fi->fh, fi->flags, time(0)};
+        opened_file.stream = make_shared<stream_reader>(userdata, path, fi->fh, server_stat.st_size);
+        user->cur_open_files[string(full_path)] = opened_file;
+        free(full_path);
+        return 0;
+    }
+    // the file may live in a directory the cache doesn't have yet
+    returnCode = make_cache_dirs(userdata, full_path);
     if (returnCode < 0) {
-        DLOG("Open Error: Download Failed");
-        fxn_ret = returnCode;
+        free(full_path);
+        return returnCode;
+    }
+
+    if (user->sparse_files) {
+        // blocks are fetched as they are used, only check the file exists
+        returnCode = get_server_attr(userdata, path, &server_stat);
+        if (returnCode < 0) {
+            DLOG("Open Error: File does not exist at the server");
+            free(full_path);
+            return returnCode;
+        }
+    }
+    else {
+        // open the file at the server and download it, small files in one rpc
+        returnCode = open_from_server(userdata, full_path, path, fi, &server_stat);
+        if (returnCode < 0) {
+            DLOG("Open Error: Download Failed");
+            fxn_ret = returnCode;
+        }
     }
 
     if (fxn_ret < 0) {
         DLOG("Open Error: open failed (couldn't download file to client)");
-        fxn_ret = -errno;
         free(full_path);
         return fxn_ret;
     }
@@ -170,22 +291,29 @@ int watdfs_cli_open(void *userdata, const char *path,
     int actual_flags = fi->flags;
 
     // open the file at the client
-    int fh = open(full_path, O_RDWR);
+    int fh = user->sparse_files ? open(full_path, O_RDWR | O_CREAT, server_stat.st_mode & 0777)
+                                : open(full_path, O_RDWR);
     std::cout << "Opened: " << fh << std::endl;
     if (fh < 0) {
         DLOG("Open Error: Could not open file on client");
         fxn_ret = -errno;
+        if (!user->sparse_files) {
+            rpc_release(userdata, path, fi);
+        }
         free(full_path);
         return fxn_ret;
     }
 
-    // open the file at the server
-    returnCode = rpc_open(userdata, path, fi);
-    if (returnCode < 0) {
-        DLOG("Open Error: Could not open file on server");
-        fxn_ret = returnCode;
-        free(full_path);
-        return fxn_ret;
+    // open the file at the server, open_from_server already has
+    if (user->sparse_files) {
+        returnCode = rpc_open(userdata, path, fi);
+        if (returnCode < 0) {
+            DLOG("Open Error: Could not open file on server");
+            fxn_ret = returnCode;
+            close(fh);
+            free(full_path);
+            return fxn_ret;
+        }
     }
 
     DLOG("File successfully opened!");
@@ -193,7 +321,23 @@ int watdfs_cli_open(void *userdata, const char *path,
     // update metadata
     std::cout << "Open File Handle: " << fh << std::endl;
     struct file_info opened_file = {fh, fi->fh, actual_flags, time(0)};
-    struct files_store *user = (struct files_store *) userdata;
+
+    // the cached copy matches the version open_from_server saw
+    if (!user->sparse_files) {
+        record_version(&opened_file, &server_stat);
+    }
+
+    if (user->sparse_files) {
+        returnCode = reset_sparse_copy(userdata, path, &opened_file);
+        if (returnCode < 0) {
+            DLOG("Open Error: Could not prepare sparse copy");
+            close(fh);
+            rpc_release(userdata, path, fi);
+            free(full_path);
+            return returnCode;
+        }
+    }
+
     user->cur_open_files[string(full_path)] = opened_file;
     fxn_ret = 0;
     free(full_path);
@@ -203,6 +347,9 @@ int watdfs_cli_open(void *userdata, const char *path,
 
 int watdfs_cli_release(void *userdata, const char *path,
                        struct fuse_file_info *fi) {
+    // let a flush in progress finish before pushing the file ourselves
+    lock_guard<mutex> flushing(((struct files_store *) userdata)->flush_mutex);
+    client_op op(userdata, path);
 
     int returnCode = 0;
 
@@ -229,13 +376,23 @@ int watdfs_cli_release(void *userdata, const char *path,
         }
    }
     
-    // close file at client
-    int fh = user->cur_open_files[full_path].client_fi;
-    returnCode = close(fh);
+    if (user->cur_open_files[full_path].stream) {
+        // stop the read-ahead, there is no local copy to close; its thread
+        // may be waiting on the server
+        shared_ptr<stream_reader> stream;
+        stream.swap(user->cur_open_files[full_path].stream);
+        store_released released;
+        stream.reset();
+    }
+    else {
+        // close file at client
+        int fh = user->cur_open_files[full_path].client_fi;
+        returnCode = close(fh);
 
-    if (returnCode < 0) {
-        free(full_path);
-        return -errno;
+        if (returnCode < 0) {
+            free(full_path);
+            return -errno;
+        }
     }
 
     //release file at server
@@ -261,19 +418,29 @@ int watdfs_cli_release(void *userdata, const char *path,
 // READ AND WRITE DATA
 int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
                     off_t offset, struct fuse_file_info *fi) {
+    client_op op(userdata, path);
 
     int returnCode = 0;
 
     // get full path
     char *full_path = get_full_path(path, userdata);
 
+    // streamed files are read from the server directly
+    shared_ptr<stream_reader> stream = ((struct files_store *) userdata)->cur_open_files[full_path].stream;
+    if (stream) {
+        free(full_path);
+        // waiting for the read-ahead must not hold up other files
+        store_released released;
+        return stream->read(buf, size, offset);
+    }
+
     // Freshness check
     bool is_fresh = is_file_fresh(userdata, full_path, path);
 
     // if not fresh, download fresh version
     if (!is_fresh) {
         DLOG("Read: File is not fresh, fetching from server...");
-        returnCode = download_from_server_to_client(userdata, full_path, path);
+        returnCode = refresh_open_file(userdata, full_path, path);
         if (returnCode < 0) {
             DLOG("Read: Could not fetch fresh data from the server");
             free(full_path);
@@ -298,6 +465,16 @@ int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
     // read file from client
     struct files_store *user = (struct files_store *) userdata;
     int fh = user->cur_open_files[full_path].client_fi;
+
+    // in sparse mode, fetch the blocks this read needs
+    returnCode = fetch_missing_blocks(userdata, path, &user->cur_open_files[full_path],
+                                      offset, size, false);
+    if (returnCode < 0) {
+        DLOG("Read: Could not fetch blocks from the server");
+        free(full_path);
+        return returnCode;
+    }
+
     std::cout << "Read File Handle: " << fh << std::endl;
     int bytes_read = pread(fh, buf, size, offset);
     DLOG("Read %d chars", bytes_read);
@@ -319,6 +496,7 @@ int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
 
 int watdfs_cli_write(void *userdata, const char *path, const char *buf,
                      size_t size, off_t offset, struct fuse_file_info *fi) {           
+    client_op op(userdata, path);
 
     int returnCode = 0; 
 
@@ -330,6 +508,16 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
     // write to client file
     struct files_store *user = (struct files_store *) userdata;
     int fh = user->cur_open_files[full_path].client_fi;
+
+    // in sparse mode, blocks written only in part must be fetched first
+    returnCode = fetch_missing_blocks(userdata, path, &user->cur_open_files[full_path],
+                                      offset, size, true);
+    if (returnCode < 0) {
+        DLOG("Write: Could not fetch blocks from the server");
+        free(full_path);
+        return returnCode;
+    }
+
     int bytes_written = pwrite(fh, buf, size, offset);
 
     if (bytes_written < 0) {
@@ -338,6 +526,9 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
         return -errno;
     }
 
+    // remember what changed so the next upload only sends these bytes
+    mark_dirty(&user->cur_open_files[full_path], offset, bytes_written);
+
     // check freshness
     bool is_fresh = is_file_fresh(userdata, full_path, path);
 
@@ -370,9 +561,13 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
 
 
 int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
+    client_op op(userdata, path);
     
     int returnCode = 0;
 
+    // the server attributes are about to change
+    invalidate_server_attr(userdata, path);
+
     // get full path
     char *full_path = get_full_path(path, userdata);
 
@@ -407,6 +602,14 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
         struct files_store *user = (struct files_store *) userdata;
         // if flag is not read only
         if (get_access_mode(user->cur_open_files[full_path].flags) != O_RDONLY) {
+            // in sparse mode, keep the bitmap in step with the local copy
+            returnCode = truncate_sparse_copy(userdata, path, &user->cur_open_files[full_path], newsize);
+            if (returnCode < 0) {
+                DLOG("Truncate: Could not fetch blocks from the server");
+                free(full_path);
+                return returnCode;
+            }
+
             // truncate
             returnCode = truncate(full_path, newsize);
 
@@ -415,6 +618,7 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
                 free(full_path);
                 return -errno;
             }
+            truncate_dirty(&user->cur_open_files[full_path], newsize);
 
             // check freshness
             bool is_fresh = is_file_fresh(userdata, full_path, path);
@@ -455,6 +659,9 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
 
 int watdfs_cli_fsync(void *userdata, const char *path,
                      struct fuse_file_info *fi) {
+    // let a flush in progress finish before pushing the file ourselves
+    lock_guard<mutex> flushing(((struct files_store *) userdata)->flush_mutex);
+    client_op op(userdata, path);
                         
     int returnCode = 0;
 
@@ -493,9 +700,13 @@ int watdfs_cli_fsync(void *userdata, const char *path,
 // CHANGE METADATA
 int watdfs_cli_utimensat(void *userdata, const char *path,
                        const struct timespec ts[2]) {
+    client_op op(userdata, path);
 
     int returnCode = 0;
 
+    // the server attributes are about to change
+    invalidate_server_attr(userdata, path);
+
     // get full path
     char *full_path = get_full_path(path, userdata);
 
@@ -575,3 +786,136 @@ int watdfs_cli_utimensat(void *userdata, const char *path,
 
     return 0;
 }
+
+// DIRECTORIES
+int watdfs_cli_opendir(void *userdata, const char *path,
+                       struct fuse_file_info *fi) {
+    client_op op(userdata, path);
+
+    // read the listing now, readdir is then served from the cache
+    const struct dir_listing *listing;
+    return get_dir_listing(userdata, path, &listing);
+}
+
+int watdfs_cli_readdir(void *userdata, const char *path, void *buf,
+                       fuse_fill_dir_t filler, off_t offset,
+                       struct fuse_file_info *fi) {
+    client_op op(userdata, path);
+
+    const struct dir_listing *listing;
+    int returnCode = get_dir_listing(userdata, path, &listing);
+    if (returnCode < 0) {
+        DLOG("Readdir: Could not read listing from server");
+        return returnCode;
+    }
+
+    // the whole listing goes out at once, offset is always 0
+    for (const struct dir_entry &entry : listing->entries) {
+        struct stat entry_stat;
+        memset(&entry_stat, 0, sizeof(entry_stat));
+        entry_stat.st_ino = entry.ino;
+        entry_stat.st_mode = DTTOIF(entry.type);
+        if (filler(buf, entry.name.c_str(), &entry_stat, 0) != 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int watdfs_cli_releasedir(void *userdata, const char *path,
+                          struct fuse_file_info *fi) {
+    // nothing is held open at the server for a directory
+    return 0;
+}
+
+int watdfs_cli_mkdir(void *userdata, const char *path, mode_t mode) {
+    client_op op(userdata, path);
+    invalidate_server_attr(userdata, path);
+    invalidate_parent_listing(userdata, path);
+    return rpc_mkdir(userdata, path, mode);
+}
+
+int watdfs_cli_rmdir(void *userdata, const char *path) {
+    client_op op(userdata, path);
+
+    int returnCode = rpc_rmdir(userdata, path);
+    if (returnCode < 0) {
+        DLOG("Rmdir: Could not remove directory at server");
+        return returnCode;
+    }
+
+    forget_cached_tree(userdata, path);
+    invalidate_parent_listing(userdata, path);
+
+    // the cached copy of the directory goes too, if it is empty
+    char *full_path = get_full_path(path, userdata);
+    rmdir(full_path);
+    free(full_path);
+    return 0;
+}
+
+// REMOVE AND RENAME
+int watdfs_cli_unlink(void *userdata, const char *path) {
+    client_op op(userdata, path);
+
+    // release would push an open file back and so recreate it at the server
+    char *full_path = get_full_path(path, userdata);
+    bool is_open = file_already_open(userdata, full_path);
+    free(full_path);
+    if (is_open) {
+        DLOG("Unlink: file is open");
+        return -EBUSY;
+    }
+
+    int returnCode = rpc_unlink(userdata, path);
+    if (returnCode < 0) {
+        DLOG("Unlink: Could not remove file at server");
+        return returnCode;
+    }
+
+    forget_cached_tree(userdata, path);
+    invalidate_parent_listing(userdata, path);
+
+    // drop the cached copy
+    full_path = get_full_path(path, userdata);
+    unlink(full_path);
+    free(full_path);
+    return 0;
+}
+
+int watdfs_cli_rename(void *userdata, const char *from, const char *to) {
+    client_op op(userdata, from, to);
+
+    // open files are tracked by cache path and pushed back to it on release,
+    // which goes for files inside a renamed directory too
+    char *full_from = get_full_path(from, userdata);
+    char *full_to = get_full_path(to, userdata);
+    if (tree_already_open(userdata, full_from) || tree_already_open(userdata, full_to)) {
+        DLOG("Rename: file is open");
+        free(full_from);
+        free(full_to);
+        return -EBUSY;
+    }
+
+    int returnCode = rpc_rename(userdata, from, to);
+    if (returnCode < 0) {
+        DLOG("Rename: Could not rename at server");
+        free(full_from);
+        free(full_to);
+        return returnCode;
+    }
+
+    forget_cached_tree(userdata, from);
+    forget_cached_tree(userdata, to);
+    invalidate_parent_listing(userdata, from);
+    invalidate_parent_listing(userdata, to);
+
+    // move the cached copy along, its blocks are still worth comparing
+    // against the next download
+    make_cache_dirs(userdata, full_to);
+    rename(full_from, full_to);
+
+    free(full_from);
+    free(full_to);
+    return 0;
+}
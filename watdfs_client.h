@@ -59,6 +59,21 @@ int watdfs_cli_fsync(void *userdata, const char *path,
 int watdfs_cli_utimensat(void *userdata, const char *path,
                        const struct timespec ts[2]);
 
+// DIRECTORIES
+int watdfs_cli_opendir(void *userdata, const char *path,
+                       struct fuse_file_info *fi);
+int watdfs_cli_readdir(void *userdata, const char *path, void *buf,
+                       fuse_fill_dir_t filler, off_t offset,
+                       struct fuse_file_info *fi);
+int watdfs_cli_releasedir(void *userdata, const char *path,
+                          struct fuse_file_info *fi);
+int watdfs_cli_mkdir(void *userdata, const char *path, mode_t mode);
+int watdfs_cli_rmdir(void *userdata, const char *path);
+
+// REMOVE AND RENAME
+int watdfs_cli_unlink(void *userdata, const char *path);
+int watdfs_cli_rename(void *userdata, const char *from, const char *to);
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,6 +6,13 @@
 #include "rpc.h"
 #include "debug.h"
 #include "global.h"
+#include "checksum.h"
+#include "bulk.h"
+#include "lease.h"
+#include "getattr_multi.h"
+#include "dir_listing.h"
+#include "lock_lease.h"
+#include "session.h"
 INIT_LOG
 
 #include <sys/stat.h>
@@ -15,6 +22,8 @@ INIT_LOG
 #include <cstring>
 #include <cstdlib>
 #include <fuse.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <iostream>
 
 // Global state server_persist_dir.
@@ -23,6 +32,24 @@ char *server_persist_dir = nullptr;
 // Open Files Data
 server_mutex *open_files = nullptr;
 
+// Descriptors shared by every open of a path
+fd_cache *fds = nullptr;
+
+// Byte range locks taken by transfers
+range_lock_table *ranges = nullptr;
+
+// Client sessions and the handles they have open
+session_table *sessions = nullptr;
+
+// Directory streams of listings being paged through, by directory and the
+// entry number the next page starts at
+struct dir_stream {
+    DIR *dir;
+    time_t used;
+};
+static mutex dir_streams_mutex;
+static map<pair<string, off_t>, struct dir_stream> dir_streams;
+
 // Important: the server needs to handle multiple concurrent client requests.
 // You have to be careful in handling global variables, especially for updating them.
 // Hint: use locks before you update any global variable.
@@ -115,6 +142,9 @@ int watdfs_mknod(int *argTypes, void **args) {
         *ret = -errno;
     }
 
+    // clients may hold a lease from before the path existed
+    lease_revoke(short_path);
+
     // Clean up the full path, it was allocated on the heap.
     free(full_path);
 
@@ -153,6 +183,9 @@ int watdfs_ultimensat(int *argTypes, void **args) {
       DLOG("sys call: utimens failed");
     }
 
+    // an upload ends here, clients caching the old version must refetch
+    lease_revoke(short_path);
+
     // Clean up the full path, it was allocated on the heap.
     free(full_path);
     DLOG("Returning code for utimens: %d", *ret);
@@ -167,7 +200,10 @@ int watdfs_open(int *argTypes, void **args) {
 
     struct fuse_file_info *fi = (struct fuse_file_info *) args[1];
 
-    int *ret = (int *) args[2];
+    // session the open belongs to
+    uint64_t *session = (uint64_t *) args[2];
+
+    int *ret = (int *) args[3];
 
     // Get the local file name, so we call our helper function which appends
     // the server_persist_dir to the given path.
@@ -177,40 +213,18 @@ int watdfs_open(int *argTypes, void **args) {
     *ret = 0;
 
     std::cout << "Open Called: " << (fi->flags & O_ACCMODE) << std::endl;
-    // add/update file metadata
-    if (!open_files->is_file_open(full_path)) {
-        // add an entry
-        open_files->add_file_entry(full_path);
-        open_files->update_mode(full_path, fi->flags);
-    }
-    else {
-        std::cout << "FLAG 2: " << (fi->flags & O_ACCMODE) << std::endl;
-        if (open_files->is_can_write(full_path)) {
-            if ((fi->flags & O_ACCMODE) == O_RDWR || (fi->flags & O_ACCMODE) == O_WRONLY) {
-                 // file is open in write mode, so request for write access is denied
-                DLOG("OPEN: Cannot allow concurrent writes");
-                return -EACCES;
-            }
-            else {
-                // Multiple readers can open a file in read only mode, do nothing
-            }
-        }
-        else {
-            DLOG("OPEN: new file mode -> %d", fi->flags);
-            open_files->update_mode(full_path, fi->flags);
-        }
-    }
-
+    // record the open under the session, refusing a second writer; the
+    // client gets the session's handle rather than the descriptor
     int sys_ret = 0;
-    sys_ret = open(full_path, O_RDWR);
+    uint64_t handle = 0;
+    sys_ret = sessions->open_handle(*session, full_path, fi->flags, &handle);
 
     DLOG("OPEN sys_ret: %d", sys_ret);
     if (sys_ret < 0) {
-        *ret = -errno;
+        *ret = sys_ret;
     }
     else {
-        fi->fh = sys_ret;
-        open_files->change(full_path, true);
+        fi->fh = handle;
     }
 
     // Clean up the full path, it was allocated on the heap.
@@ -221,13 +235,95 @@ int watdfs_open(int *argTypes, void **args) {
     return 0;
 }
 
+// Open, stat and read the head of a file in one rpc. The read lock is held
+// throughout, so an upload can't land between the stat and the read.
+int watdfs_openfetch(int *argTypes, void **args) {
+
+    char *short_path = (char *) args[0];
+
+    struct fuse_file_info *fi = (struct fuse_file_info *) args[1];
+
+    struct stat *statbuf = (struct stat *) args[2];
+
+    void *buf = args[3];
+
+    size_t *size = (size_t *) args[4];
+
+    // session the open belongs to
+    uint64_t *session = (uint64_t *) args[5];
+
+    int *ret = (int *) args[6];
+
+    // never read more than the reply array holds
+    if (*size > (size_t) (argTypes[3] & 0xffff)) {
+        *size = argTypes[3] & 0xffff;
+    }
+
+    // Get the local file name, so we call our helper function which appends
+    // the server_persist_dir to the given path.
+    char *full_path = get_full_path(short_path);
+
+    // a contended file fails with -EAGAIN rather than parking this thread,
+    // the client then queues for the lock like any download
+    *ret = ranges->lock(full_path, 0, RANGE_EOF, RW_READ_LOCK, 0, 0);
+    bool locked = *ret == 0;
+
+    int sys_ret = 0;
+    if (locked) {
+        sys_ret = stat(full_path, statbuf);
+        if (sys_ret < 0) {
+            *ret = -errno;
+        }
+    }
+
+    // record the open under the session, refusing a second writer
+    uint64_t handle = 0;
+    if (*ret == 0) {
+        *ret = sessions->open_handle(*session, full_path, fi->flags, &handle);
+    }
+
+    if (*ret == 0) {
+        fi->fh = handle;
+        int fd = sessions->use(*session, handle, false);
+        sys_ret = fd < 0 ? fd : pread(fd, buf, *size, 0);
+        if (sys_ret < 0) {
+            *ret = fd < 0 ? fd : -errno;
+        }
+        else {
+            *ret = sys_ret;
+        }
+        if (fd >= 0) {
+            sessions->done(fd);
+        }
+
+        // leave nothing open behind a failed call
+        if (*ret < 0) {
+            sessions->close_handle(*session, handle);
+        }
+    }
+
+    if (locked) {
+        ranges->unlock(full_path, 0, RANGE_EOF, RW_READ_LOCK, 0);
+    }
+
+    // Clean up the full path, it was allocated on the heap.
+    free(full_path);
+
+    DLOG("Returning code for openfetch: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
 int watdfs_release(int *argTypes, void **args) {
     
     char *short_path = (char *) args[0];
 
     struct fuse_file_info *fi = (struct fuse_file_info *) args[1];
 
-    int *ret = (int *) args[2];
+    // session the handle belongs to
+    uint64_t *session = (uint64_t *) args[2];
+
+    int *ret = (int *) args[3];
 
     // Get the local file name, so we call our helper function which appends
     // the server_persist_dir to the given path.
@@ -236,21 +332,14 @@ int watdfs_release(int *argTypes, void **args) {
     // Initially we set the return code to be 0.
     *ret = 0;
 
+    // drop the handle and its open; the descriptor stays cached for later
+    // opens of this path
     int sys_ret = 0;
-    sys_ret = close(fi->fh);
-
-    open_files->change(full_path, false);
-
-    // remove file from opened_files tracker
-    int count = open_files->get_count(full_path);
-    std::cout << "Release Called: " << count << std::endl;
-    if (count == 0) {
-        open_files->remove_file_entry(full_path);
-    }
+    sys_ret = sessions->close_handle(*session, fi->fh);
 
     DLOG("RELEASE sys_ret: %d", sys_ret);
     if (sys_ret < 0) {
-        *ret = -errno;
+        *ret = sys_ret;
     }
 
      // Clean up the full path, it was allocated on the heap.
@@ -273,7 +362,10 @@ int watdfs_read(int *argTypes, void **args) {
 
     struct fuse_file_info *fi = (struct fuse_file_info *) args[4];
 
-    int *ret = (int *) args[5];
+    // session the handle belongs to
+    uint64_t *session = (uint64_t *) args[5];
+
+    int *ret = (int *) args[6];
 
     // Get the local file name, so we call our helper function which appends
     // the server_persist_dir to the given path.
@@ -281,15 +373,22 @@ int watdfs_read(int *argTypes, void **args) {
 
     *ret = 0;
 
+    // This is the fallback for clients without the bulk channel. The rpc
+    // library owns the output buffer and the socket, so the data has to be
+    // copied here; the bulk channel sends it with sendfile instead.
     int sys_ret = 0;
-    sys_ret = pread(fi->fh, buf, *size, *offset);
+    int fd = sessions->use(*session, fi->fh, false);
+    sys_ret = fd < 0 ? fd : pread(fd, buf, *size, *offset);
 
     if (sys_ret < 0) {
-        *ret = -errno;
+        *ret = fd < 0 ? fd : -errno;
     }
     else {
         *ret = sys_ret;
     }
+    if (fd >= 0) {
+        sessions->done(fd);
+    }
 
      // Clean up the full path, it was allocated on the heap.
     free(full_path);
@@ -311,7 +410,10 @@ int watdfs_write(int *argTypes, void **args) {
 
     struct fuse_file_info *fi = (struct fuse_file_info *) args[4];
 
-    int *ret = (int *) args[5];
+    // session the handle belongs to
+    uint64_t *session = (uint64_t *) args[5];
+
+    int *ret = (int *) args[6];
 
     // Get the local file name, so we call our helper function which appends
     // the server_persist_dir to the given path.
@@ -320,14 +422,22 @@ int watdfs_write(int *argTypes, void **args) {
     *ret = 0;
 
     int sys_ret = 0;
-    sys_ret = pwrite(fi->fh, buf, *size, *offset);
+    int fd = sessions->use(*session, fi->fh, true);
+    sys_ret = fd < 0 ? fd : pwrite(fd, buf, *size, *offset);
 
     if (sys_ret < 0) {
-        *ret = -errno;
+        *ret = fd < 0 ? fd : -errno;
     }
     else {
         *ret = sys_ret;
     }
+    if (fd >= 0) {
+        sessions->done(fd);
+    }
+
+    // bulk channel writes have no path, but an upload always starts with a
+    // truncate and ends with utimensat, which revoke leases too
+    lease_revoke(short_path);
 
      // Clean up the full path, it was allocated on the heap.
     free(full_path);
@@ -359,6 +469,8 @@ int watdfs_truncate(int *argTypes, void **args) {
         *ret = -errno;
     }
 
+    lease_revoke(short_path);
+
      // Clean up the full path, it was allocated on the heap.
     free(full_path);
 
@@ -373,7 +485,10 @@ int watdfs_fsync(int *argTypes, void **args) {
 
     struct fuse_file_info *fi = (struct fuse_file_info *) args[1];
 
-    int *ret = (int *) args[2];
+    // session the handle belongs to
+    uint64_t *session = (uint64_t *) args[2];
+
+    int *ret = (int *) args[3];
 
     // Get the local file name, so we call our helper function which appends
     // the server_persist_dir to the given path.
@@ -382,10 +497,14 @@ int watdfs_fsync(int *argTypes, void **args) {
     *ret = 0;
 
     int sys_ret = 0;
-    sys_ret = fsync(fi->fh);
+    int fd = sessions->use(*session, fi->fh, false);
+    sys_ret = fd < 0 ? fd : fsync(fd);
 
     if (sys_ret < 0) {
-        *ret = -errno;
+        *ret = fd < 0 ? fd : -errno;
+    }
+    if (fd >= 0) {
+        sessions->done(fd);
     }
 
      // Clean up the full path, it was allocated on the heap.
@@ -396,229 +515,797 @@ int watdfs_fsync(int *argTypes, void **args) {
     return 0;
 }
 
-int watdfs_lock(int *argTypes, void **args) {
+int watdfs_lockrange(int *argTypes, void **args) {
 
     char *short_path = (char *) args[0];
 
-    rw_lock_mode_t *mode = (rw_lock_mode_t *) args[1];
+    off_t *offset = (off_t *) args[1];
 
-    int *ret = (int *) args[2];
+    off_t *len = (off_t *) args[2];
+
+    rw_lock_mode_t *mode = (rw_lock_mode_t *) args[3];
+
+    uint64_t *owner = (uint64_t *) args[4];
+
+    // set if the range is queued, for pollrange and cancelrange
+    uint64_t *ticket = (uint64_t *) args[5];
+
+    int *ret = (int *) args[6];
 
     // Get the local file name, so we call our helper function which appends
     // the server_persist_dir to the given path.
     char *full_path = get_full_path(short_path);
 
+    // a contended range is queued, this thread doesn't wait for it
     int sys_ret = 0;
-    sys_ret = rw_lock_lock(open_files->get_lock(full_path), *mode);
+    *ticket = 0;
+    sys_ret = ranges->request(full_path, *offset, *len, *mode, *owner, ticket);
 
     *ret = sys_ret;
 
      // Clean up the full path, it was allocated on the heap.
     free(full_path);
 
-    DLOG("Returning code for lock: %d", *ret);
+    DLOG("Returning code for lockrange: %d", *ret);
     // The RPC call succeeded, so return 0.
     return 0;
 }
 
-int watdfs_unlock(int *argTypes, void **args) {
+int watdfs_unlockrange(int *argTypes, void **args) {
 
     char *short_path = (char *) args[0];
 
-    rw_lock_mode_t *mode = (rw_lock_mode_t *) args[1];
+    off_t *offset = (off_t *) args[1];
 
-    int *ret = (int *) args[2];
+    off_t *len = (off_t *) args[2];
+
+    rw_lock_mode_t *mode = (rw_lock_mode_t *) args[3];
+
+    uint64_t *owner = (uint64_t *) args[4];
+
+    int *ret = (int *) args[5];
 
     // Get the local file name, so we call our helper function which appends
     // the server_persist_dir to the given path.
     char *full_path = get_full_path(short_path);
 
     int sys_ret = 0;
-    sys_ret = rw_lock_unlock(open_files->get_lock(full_path), *mode);
+    sys_ret = ranges->unlock(full_path, *offset, *len, *mode, *owner);
 
     *ret = sys_ret;
 
      // Clean up the full path, it was allocated on the heap.
     free(full_path);
 
-    DLOG("Returning code for unlock: %d", *ret);
+    DLOG("Returning code for unlockrange: %d", *ret);
     // The RPC call succeeded, so return 0.
     return 0;
 }
 
-// The main function of the server.
-int main(int argc, char *argv[]) {
-    // argv[1] should contain the directory where you should store data on the
-    // server. If it is not present it is an error, that we cannot recover from.
-    if (argc != 2) {
-        // In general, you shouldn't print to stderr or stdout, but it may be
-        // helpful here for debugging. Important: Make sure you turn off logging
-        // prior to submission!
-        // See watdfs_client.cpp for more details
-        // # ifdef PRINT_ERR
-        // std::cerr << "Usage:" << argv[0] << " server_persist_dir";
-        // #endif
-        return -1;
-    }
-    // Store the directory in a global variable.
-    server_persist_dir = argv[1];
-    
-    // Init open files store
-    open_files = new server_mutex;
+int watdfs_pollrange(int *argTypes, void **args) {
 
-    // TODO: Initialize the rpc library by calling `rpcServerInit`.
-    // Important: `rpcServerInit` prints the 'export SERVER_ADDRESS' and
-    // 'export SERVER_PORT' lines. Make sure you *do not* print anything
-    // to *stdout* before calling `rpcServerInit`.
-    //DLOG("Initializing server...");
-    int rpcInitCode = rpcServerInit();
-    DLOG("Initializing server...");
+    uint64_t *ticket = (uint64_t *) args[0];
 
-    int ret = 0;
-    // If there is an error with `rpcServerInit`, it maybe useful to have
-    // debug-printing here, and then you should return.
-    if (rpcInitCode != 0) {
-        // rpc server init failed
-        DLOG("Failed to initialize RPC Server ");
-        return rpcInitCode;
-    }
+    int *ret = (int *) args[1];
 
-    // TODO: Register your functions with the RPC library.
-    // Note: The braces are used to limit the scope of `argTypes`, so that you can
-    // reuse the variable for multiple registrations. Another way could be to
-    // remove the braces and use `argTypes0`, `argTypes1`, etc.
-    {
-        // There are 3 args for the function (see watdfs_client.cpp for more
-        // detail).
-        int argTypes[4];
-        // First is the path.
-        argTypes[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
-        // The second argument is the statbuf.
-        argTypes[1] =
-            (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
-        // The third argument is the retcode.
-        argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
-        // Finally we fill in the null terminator.
-        argTypes[3] = 0;
+    *ret = ranges->poll(*ticket);
 
-        // We need to register the function with the types and the name.
-        ret = rpcRegister((char *)"getattr", argTypes, watdfs_getattr);
-        if (ret < 0) {
-            DLOG("get attr failed");
-            return ret;
-        }
-        DLOG("get attr succeeded");
-    }
+    DLOG("Returning code for pollrange: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
 
-    // for mknode
-    {
-        int argTypes[5];
+int watdfs_cancelrange(int *argTypes, void **args) {
 
-        argTypes[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+    uint64_t *ticket = (uint64_t *) args[0];
 
-        argTypes[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+    int *ret = (int *) args[1];
 
-        argTypes[2] =  (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    *ret = ranges->cancel(*ticket);
 
-        argTypes[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    DLOG("Returning code for cancelrange: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
 
-        argTypes[4] = 0;
+int watdfs_opensession(int *argTypes, void **args) {
 
-        ret = rpcRegister((char *)"mknod", argTypes, watdfs_mknod);
-        if (ret < 0) {
-            DLOG("mknod failed");
-            return ret;
-        }
-        DLOG("mknod succeeded");
-    }
+    uint64_t *session = (uint64_t *) args[0];
 
-    // for ultimensat
-    {
+    int *ret = (int *) args[1];
 
-        int argTypes[4];
+    *session = sessions->open();
+    *ret = 0;
 
-        argTypes[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+    DLOG("Returning code for opensession: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
 
-        argTypes[1] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+int watdfs_heartbeat(int *argTypes, void **args) {
 
-        argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    uint64_t *session = (uint64_t *) args[0];
 
-        argTypes[3] = 0;
+    int *ret = (int *) args[1];
 
-        ret = rpcRegister((char *) "ultimensat", argTypes, watdfs_ultimensat);
+    // also renews the range locks the session owns
+    *ret = sessions->heartbeat(*session);
 
-        if (ret < 0) {
-            DLOG("ultimensat failed");
-	        return ret;
-        }
-        DLOG("ultimensat succeeded");
-    }
+    DLOG("Returning code for heartbeat: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
 
-    // for open
-    {
-        int argTypes[4];
+int watdfs_closesession(int *argTypes, void **args) {
 
-        argTypes[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+    uint64_t *session = (uint64_t *) args[0];
 
-        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+    int *ret = (int *) args[1];
 
-        argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    *ret = sessions->close(*session);
 
-        argTypes[3] = 0;
+    DLOG("Returning code for closesession: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
 
-        ret = rpcRegister((char *)"open", argTypes, watdfs_open);
-        if (ret < 0) {
-            DLOG("open failed");
-            return ret;
-        }
-        DLOG("open succeeded");
-    }
+int watdfs_checksums(int *argTypes, void **args) {
 
-    // for release 
-    {
-        int argTypes[4];
+    char *short_path = (char *) args[0];
 
-        argTypes[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
-            
-        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+    uint64_t *hashes = (uint64_t *) args[1];
 
-        argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    size_t *count = (size_t *) args[2];
 
-        argTypes[3] = 0;
+    off_t *first_block = (off_t *) args[3];
 
-        // We need to register the function with the types and the name.
-        ret = rpcRegister((char *) "release", argTypes, watdfs_release);
-        if (ret < 0) {
-            DLOG("release failed");
-            return ret;
-        }
-        DLOG("release succeeded");
-    }
+    int *ret = (int *) args[4];
 
-    // for read 
-    {
-        int argTypes[7];
+    // Get the local file name, so we call our helper function which appends
+    // the server_persist_dir to the given path.
+    char *full_path = get_full_path(short_path);
 
-        argTypes[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+    *ret = 0;
 
-        argTypes[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0) {
+        *ret = -errno;
+        free(full_path);
+        DLOG("Returning code for checksums: %d", *ret);
+        return 0;
+    }
 
-        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    // never fill more hashes than the reply array holds
+    size_t capacity = (argTypes[1] & 0xffff) / sizeof(uint64_t);
+    if (*count > capacity) {
+        *count = capacity;
+    }
 
-        argTypes[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+    // hash each requested block, stopping early at the end of the file
+    char *block = (char *) malloc(BLOCK_SIZE);
+    size_t filled = 0;
+    while (filled < *count) {
+        off_t block_offset = (*first_block + (off_t) filled) * BLOCK_SIZE;
+        int sys_ret = pread(fd, block, BLOCK_SIZE, block_offset);
+        if (sys_ret < 0) {
+            *ret = -errno;
+            break;
+        }
+        if (sys_ret == 0) {
+            break;
+        }
+        hashes[filled] = block_checksum(block, sys_ret);
+        filled += 1;
+    }
 
-        argTypes[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
-        
-        argTypes[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+    if (*ret == 0) {
+        *ret = filled;
+    }
 
-        argTypes[6] = 0;
+    free(block);
+    close(fd);
+
+     // Clean up the full path, it was allocated on the heap.
+    free(full_path);
+
+    DLOG("Returning code for checksums: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+int watdfs_bulkport(int *argTypes, void **args) {
+
+    int *ret = (int *) args[0];
+
+    // port of the bulk data channel, or -errno if it failed to start
+    *ret = bulk_server_port();
+
+    DLOG("Returning code for bulkport: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+int watdfs_mkdir(int *argTypes, void **args) {
+
+    char *short_path = (char *) args[0];
+
+    mode_t *mode = (mode_t *) args[1];
+
+    int *ret = (int *) args[2];
+
+    // Get the local file name, so we call our helper function which appends
+    // the server_persist_dir to the given path.
+    char *full_path = get_full_path(short_path);
+
+    *ret = 0;
+
+    int sys_ret = 0;
+    sys_ret = mkdir(full_path, *mode);
+
+    DLOG("MKDIR sys_ret: %d", sys_ret);
+    if (sys_ret < 0) {
+        *ret = -errno;
+    }
+
+    // Clean up the full path, it was allocated on the heap.
+    free(full_path);
+
+    DLOG("Returning code for mkdir: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+int watdfs_unlink(int *argTypes, void **args) {
+
+    char *short_path = (char *) args[0];
+
+    int *ret = (int *) args[1];
+
+    // Get the local file name, so we call our helper function which appends
+    // the server_persist_dir to the given path.
+    char *full_path = get_full_path(short_path);
+
+    *ret = 0;
+
+    int sys_ret = 0;
+    sys_ret = unlink(full_path);
+
+    DLOG("UNLINK sys_ret: %d", sys_ret);
+    if (sys_ret < 0) {
+        *ret = -errno;
+    }
+    else {
+        // a later file at this path must get a descriptor of its own
+        fds->invalidate(full_path);
+        lease_revoke(short_path);
+    }
+
+    // Clean up the full path, it was allocated on the heap.
+    free(full_path);
+
+    DLOG("Returning code for unlink: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+int watdfs_rmdir(int *argTypes, void **args) {
+
+    char *short_path = (char *) args[0];
+
+    int *ret = (int *) args[1];
+
+    // Get the local file name, so we call our helper function which appends
+    // the server_persist_dir to the given path.
+    char *full_path = get_full_path(short_path);
+
+    *ret = 0;
+
+    int sys_ret = 0;
+    sys_ret = rmdir(full_path);
+
+    DLOG("RMDIR sys_ret: %d", sys_ret);
+    if (sys_ret < 0) {
+        *ret = -errno;
+    }
+    else {
+        lease_revoke(short_path);
+    }
+
+    // Clean up the full path, it was allocated on the heap.
+    free(full_path);
+
+    DLOG("Returning code for rmdir: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+int watdfs_rename(int *argTypes, void **args) {
+
+    char *short_from = (char *) args[0];
+
+    char *short_to = (char *) args[1];
+
+    int *ret = (int *) args[2];
+
+    // Get the local file names, so we call our helper function which appends
+    // the server_persist_dir to the given paths.
+    char *full_from = get_full_path(short_from);
+    char *full_to = get_full_path(short_to);
+
+    *ret = 0;
+
+    int sys_ret = 0;
+    sys_ret = rename(full_from, full_to);
+
+    DLOG("RENAME sys_ret: %d", sys_ret);
+    if (sys_ret < 0) {
+        *ret = -errno;
+    }
+    else {
+        // neither path names the file its descriptor was opened for anymore
+        fds->invalidate(full_from);
+        fds->invalidate(full_to);
+        lease_revoke(short_from);
+        lease_revoke(short_to);
+    }
+
+    // Clean up the full paths, they were allocated on the heap.
+    free(full_from);
+    free(full_to);
+
+    DLOG("Returning code for rename: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+// Take the stream a previous page of full_path left at entry cookie, or open
+// the directory and skip to that entry if there is none. Returns nullptr and
+// sets errno if the directory can't be opened.
+static DIR *take_dir_stream(const char *full_path, off_t cookie) {
+    if (cookie > 0) {
+        lock_guard<mutex> guard(dir_streams_mutex);
+        auto it = dir_streams.find(make_pair(string(full_path), cookie));
+        if (it != dir_streams.end()) {
+            DIR *dir = it->second.dir;
+            dir_streams.erase(it);
+            return dir;
+        }
+    }
+
+    // a new listing, or one whose stream was closed meanwhile
+    DIR *dir = opendir(full_path);
+    for (off_t position = 0; dir != nullptr && position < cookie; position++) {
+        if (readdir(dir) == nullptr) {
+            break;
+        }
+    }
+    return dir;
+}
+
+// Keep dir for the page of full_path starting at entry cookie. Streams left
+// unread for READDIR_STREAM_SECONDS are closed, and so is the oldest one once
+// READDIR_STREAMS are kept.
+static void keep_dir_stream(const char *full_path, off_t cookie, DIR *dir) {
+    time_t now = time(0);
+    vector<DIR *> closing;
+    {
+        lock_guard<mutex> guard(dir_streams_mutex);
+        auto oldest = dir_streams.end();
+        for (auto it = dir_streams.begin(); it != dir_streams.end();) {
+            if (now - it->second.used >= READDIR_STREAM_SECONDS) {
+                closing.push_back(it->second.dir);
+                it = dir_streams.erase(it);
+                continue;
+            }
+            if (oldest == dir_streams.end() || it->second.used < oldest->second.used) {
+                oldest = it;
+            }
+            it++;
+        }
+        if (dir_streams.size() >= READDIR_STREAMS && oldest != dir_streams.end()) {
+            closing.push_back(oldest->second.dir);
+            dir_streams.erase(oldest);
+        }
+
+        // another listing may already wait at the same page
+        struct dir_stream kept = {dir, now};
+        if (!dir_streams.insert(make_pair(make_pair(string(full_path), cookie), kept)).second) {
+            closing.push_back(dir);
+        }
+    }
+
+    for (DIR *closed : closing) {
+        closedir(closed);
+    }
+}
+
+// Return one page of a directory listing, starting at entry number cookie.
+// next is the cookie of the following page, or -1 after the last one.
+int watdfs_readdir(int *argTypes, void **args) {
+
+    char *short_path = (char *) args[0];
+
+    off_t *cookie = (off_t *) args[1];
+
+    char *buf = (char *) args[2];
+
+    off_t *next = (off_t *) args[3];
+
+    int *ret = (int *) args[4];
+
+    // the page array is as long as the client made it
+    size_t page_size = argTypes[2] & 0xffff;
+
+    // Get the local file name, so we call our helper function which appends
+    // the server_persist_dir to the given path.
+    char *full_path = get_full_path(short_path);
+
+    *ret = 0;
+    *next = -1;
+
+    // Pages after the first continue the stream the previous page left off,
+    // so a listing reads the directory once instead of once per page.
+    DIR *dir = take_dir_stream(full_path, *cookie);
+    if (dir == nullptr) {
+        *ret = -errno;
+        free(full_path);
+        DLOG("Returning code for readdir: %d", *ret);
+        return 0;
+    }
+
+    off_t position = *cookie;
+    size_t used = 0;
+    int count = 0;
+    while (true) {
+        long before = telldir(dir);
+        struct dirent *entry = readdir(dir);
+        if (entry == nullptr) {
+            break;
+        }
+
+        size_t name_len = strlen(entry->d_name);
+        size_t record_len = DIR_RECORD_LEN(name_len);
+        if (used + record_len > page_size) {
+            // this entry starts the next page, leave the stream before it
+            seekdir(dir, before);
+            *next = position;
+            break;
+        }
+
+        struct dir_record record;
+        record.ino = entry->d_ino;
+        record.type = entry->d_type;
+        record.name_len = name_len;
+        memcpy(buf + used, &record, sizeof(record));
+        memset(buf + used + sizeof(record), 0, record_len - sizeof(record));
+        memcpy(buf + used + sizeof(record), entry->d_name, name_len);
+
+        used += record_len;
+        count += 1;
+        position += 1;
+    }
+
+    if (*next >= 0) {
+        keep_dir_stream(full_path, *next, dir);
+    }
+    else {
+        closedir(dir);
+    }
+
+    *ret = count;
+
+    // Clean up the full path, it was allocated on the heap.
+    free(full_path);
+
+    DLOG("Returning code for readdir: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+int watdfs_getattr_multi(int *argTypes, void **args) {
+
+    // NUL terminated paths, one after another
+    char *paths = (char *) args[0];
+
+    int *count = (int *) args[1];
+
+    struct attr_result *results = (struct attr_result *) args[2];
+
+    int *ret = (int *) args[3];
+
+    // the paths array must hold count terminated strings
+    int paths_len = argTypes[0] & 0xffff;
+
+    // and the results array count results
+    int capacity = (argTypes[2] & 0xffff) / sizeof(struct attr_result);
+    if (*count < 0 || *count > capacity) {
+        *ret = -EINVAL;
+        DLOG("Returning code for getattr_multi: %d", *ret);
+        return 0;
+    }
+
+    *ret = 0;
+
+    int offset = 0;
+    int filled = 0;
+    while (filled < *count && offset < paths_len) {
+        char *short_path = paths + offset;
+        size_t len = strnlen(short_path, paths_len - offset);
+        if (offset + (int) len >= paths_len) {
+            break;
+        }
+
+        // Get the local file name, so we call our helper function which appends
+        // the server_persist_dir to the given path.
+        char *full_path = get_full_path(short_path);
+
+        results[filled].result = 0;
+        results[filled].unused = 0;
+        if (stat(full_path, &results[filled].attr) < 0) {
+            results[filled].result = -errno;
+        }
+
+        // Clean up the full path, it was allocated on the heap.
+        free(full_path);
+
+        offset += len + 1;
+        filled += 1;
+    }
+
+    if (filled < *count) {
+        *ret = -EINVAL;
+    }
+    else {
+        *ret = filled;
+    }
+
+    DLOG("Returning code for getattr_multi: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+int watdfs_lease(int *argTypes, void **args) {
+
+    char *short_path = (char *) args[0];
+
+    int *client_id = (int *) args[1];
+
+    struct timespec *mtime = (struct timespec *) args[2];
+
+    off_t *size = (off_t *) args[3];
+
+    int *ret = (int *) args[4];
+
+    // Get the local file name, so we call our helper function which appends
+    // the server_persist_dir to the given path.
+    char *full_path = get_full_path(short_path);
+
+    // lease length in seconds, 0 if the client's view is already stale
+    *ret = lease_grant(*client_id, short_path, full_path, mtime, *size);
+
+     // Clean up the full path, it was allocated on the heap.
+    free(full_path);
+
+    DLOG("Returning code for lease: %d", *ret);
+    // The RPC call succeeded, so return 0.
+    return 0;
+}
+
+// The main function of the server.
+int main(int argc, char *argv[]) {
+    // argv[1] should contain the directory where you should store data on the
+    // server. If it is not present it is an error, that we cannot recover from.
+    if (argc != 2) {
+        // In general, you shouldn't print to stderr or stdout, but it may be
+        // helpful here for debugging. Important: Make sure you turn off logging
+        // prior to submission!
+        // See watdfs_client.cpp for more details
+        // # ifdef PRINT_ERR
+        // std::cerr << "Usage:" << argv[0] << " server_persist_dir";
+        // #endif
+        return -1;
+    }
+    // Store the directory in a global variable.
+    server_persist_dir = argv[1];
+    
+    // Init open files store
+    open_files = new server_mutex;
+
+    // Init descriptor cache, its size can be set with WATDFS_FD_CACHE_SIZE
+    size_t fd_cache_size = FD_CACHE_SIZE;
+    const char *fd_cache_env = getenv("WATDFS_FD_CACHE_SIZE");
+    if (fd_cache_env != nullptr && atoi(fd_cache_env) > 0) {
+        fd_cache_size = atoi(fd_cache_env);
+    }
+    fds = new fd_cache(fd_cache_size);
+
+    // Init range locks, leased for WATDFS_LOCK_LEASE_SECONDS
+    int lock_lease = LOCK_LEASE_SECONDS;
+    const char *lock_lease_env = getenv("WATDFS_LOCK_LEASE_SECONDS");
+    if (lock_lease_env != nullptr && atoi(lock_lease_env) > 0) {
+        lock_lease = atoi(lock_lease_env);
+    }
+    ranges = new range_lock_table(lock_lease);
+
+    // Init client sessions, ended after WATDFS_SESSION_SECONDS without a
+    // heartbeat
+    int session_timeout = SESSION_SECONDS;
+    const char *session_env = getenv("WATDFS_SESSION_SECONDS");
+    if (session_env != nullptr && atoi(session_env) > 0) {
+        session_timeout = atoi(session_env);
+    }
+    sessions = new session_table(session_timeout, open_files, fds, ranges);
+
+    // Length of the leases handed to clients, WATDFS_LEASE_SECONDS=0 turns
+    // them off
+    const char *lease_env = getenv("WATDFS_LEASE_SECONDS");
+    lease_server_init(lease_env != nullptr ? atoi(lease_env) : LEASE_SECONDS);
+
+    // TODO: Initialize the rpc library by calling `rpcServerInit`.
+    // Important: `rpcServerInit` prints the 'export SERVER_ADDRESS' and
+    // 'export SERVER_PORT' lines. Make sure you *do not* print anything
+    // to *stdout* before calling `rpcServerInit`.
+    //DLOG("Initializing server...");
+    int rpcInitCode = rpcServerInit();
+    DLOG("Initializing server...");
+
+    int ret = 0;
+    // If there is an error with `rpcServerInit`, it maybe useful to have
+    // debug-printing here, and then you should return.
+    if (rpcInitCode != 0) {
+        // rpc server init failed
+        DLOG("Failed to initialize RPC Server ");
+        return rpcInitCode;
+    }
+
+    // Open the bulk data channel next to the rpc library. Clients fall back
+    // to read/write rpcs if it can't be started.
+    if (bulk_server_init(sessions) < 0) {
+        DLOG("Failed to initialize bulk channel, serving data over rpcs");
+    }
+
+    // TODO: Register your functions with the RPC library.
+    // Note: The braces are used to limit the scope of `argTypes`, so that you can
+    // reuse the variable for multiple registrations. Another way could be to
+    // remove the braces and use `argTypes0`, `argTypes1`, etc.
+    {
+        // There are 3 args for the function (see watdfs_client.cpp for more
+        // detail).
+        int argTypes[4];
+        // First is the path.
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        // The second argument is the statbuf.
+        argTypes[1] =
+            (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        // The third argument is the retcode.
+        argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+        // Finally we fill in the null terminator.
+        argTypes[3] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *)"getattr", argTypes, watdfs_getattr);
+        if (ret < 0) {
+            DLOG("get attr failed");
+            return ret;
+        }
+        DLOG("get attr succeeded");
+    }
+
+    // for mknode
+    {
+        int argTypes[5];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+
+        argTypes[2] =  (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[4] = 0;
+
+        ret = rpcRegister((char *)"mknod", argTypes, watdfs_mknod);
+        if (ret < 0) {
+            DLOG("mknod failed");
+            return ret;
+        }
+        DLOG("mknod succeeded");
+    }
+
+    // for ultimensat
+    {
+
+        int argTypes[4];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[3] = 0;
+
+        ret = rpcRegister((char *) "ultimensat", argTypes, watdfs_ultimensat);
+
+        if (ret < 0) {
+            DLOG("ultimensat failed");
+	        return ret;
+        }
+        DLOG("ultimensat succeeded");
+    }
+
+    // for open
+    {
+        int argTypes[5];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[4] = 0;
+
+        ret = rpcRegister((char *)"open", argTypes, watdfs_open);
+        if (ret < 0) {
+            DLOG("open failed");
+            return ret;
+        }
+        DLOG("open succeeded");
+    }
+
+    // for release 
+    {
+        int argTypes[5];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+            
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[4] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "release", argTypes, watdfs_release);
+        if (ret < 0) {
+            DLOG("release failed");
+            return ret;
+        }
+        DLOG("release succeeded");
+    }
+
+    // for read 
+    {
+        int argTypes[8];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        
+        argTypes[5] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[7] = 0;
 
         // We need to register the function with the types and the name.
         ret = rpcRegister((char *) "read", argTypes, watdfs_read);
@@ -630,7 +1317,7 @@ int main(int argc, char *argv[]) {
     }
 
     {
-        int argTypes[7];
+        int argTypes[8];
 
         argTypes[0] =
             (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
@@ -643,9 +1330,11 @@ int main(int argc, char *argv[]) {
 
         argTypes[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
 
-        argTypes[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+        argTypes[5] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
 
-        argTypes[6] = 0;
+        argTypes[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[7] = 0;
 
         // We need to register the function with the types and the name.
         ret = rpcRegister((char *) "write", argTypes, watdfs_write);
@@ -680,16 +1369,18 @@ int main(int argc, char *argv[]) {
 
     // for fysnc 
     {
-        int argTypes[4];
+        int argTypes[5];
 
         argTypes[0] =
             (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
 
         argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
 
-        argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
 
-        argTypes[3] = 0;
+        argTypes[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[4] = 0;
 
         // We need to register the function with the types and the name.
         ret = rpcRegister((char *) "fsync", argTypes, watdfs_fsync);
@@ -700,48 +1391,367 @@ int main(int argc, char *argv[]) {
         DLOG("fsync succeeded");
     }
 
-    // for lock
+    // for lockrange
+    {
+        int argTypes[8];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[3] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+
+        argTypes[4] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[5] = (1u << ARG_OUTPUT) | (ARG_LONG << 16u);
+
+        argTypes[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[7] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "lockrange", argTypes, watdfs_lockrange);
+        if (ret < 0) {
+            DLOG("lockrange failed");
+            return ret;
+        }
+        DLOG("lockrange succeeded");
+    }
+
+    // for unlockrange
+    {
+        int argTypes[7];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[3] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+
+        argTypes[4] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[5] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[6] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "unlockrange", argTypes, watdfs_unlockrange);
+        if (ret < 0) {
+            DLOG("unlockrange failed");
+            return ret;
+        }
+        DLOG("unlockrange succeeded");
+    }
+
+    // for pollrange and cancelrange
+    {
+        int argTypes[3];
+
+        argTypes[0] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[2] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "pollrange", argTypes, watdfs_pollrange);
+        if (ret < 0) {
+            DLOG("pollrange failed");
+            return ret;
+        }
+        DLOG("pollrange succeeded");
+
+        ret = rpcRegister((char *) "cancelrange", argTypes, watdfs_cancelrange);
+        if (ret < 0) {
+            DLOG("cancelrange failed");
+            return ret;
+        }
+        DLOG("cancelrange succeeded");
+    }
+
+    // for opensession
+    {
+        int argTypes[3];
+
+        argTypes[0] = (1u << ARG_OUTPUT) | (ARG_LONG << 16u);
+
+        argTypes[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[2] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "opensession", argTypes, watdfs_opensession);
+        if (ret < 0) {
+            DLOG("opensession failed");
+            return ret;
+        }
+        DLOG("opensession succeeded");
+    }
+
+    // for heartbeat and closesession
+    {
+        int argTypes[3];
+
+        argTypes[0] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[2] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "heartbeat", argTypes, watdfs_heartbeat);
+        if (ret < 0) {
+            DLOG("heartbeat failed");
+            return ret;
+        }
+        DLOG("heartbeat succeeded");
+
+        ret = rpcRegister((char *) "closesession", argTypes, watdfs_closesession);
+        if (ret < 0) {
+            DLOG("closesession failed");
+            return ret;
+        }
+        DLOG("closesession succeeded");
+    }
+
+    // for checksums
+    {
+        int argTypes[6];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[2] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[4] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[5] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "checksums", argTypes, watdfs_checksums);
+        if (ret < 0) {
+            DLOG("checksums failed");
+            return ret;
+        }
+        DLOG("checksums succeeded");
+    }
+
+    // for bulkport
+    {
+        int argTypes[2];
+
+        argTypes[0] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[1] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "bulkport", argTypes, watdfs_bulkport);
+        if (ret < 0) {
+            DLOG("bulkport failed");
+            return ret;
+        }
+        DLOG("bulkport succeeded");
+    }
+
+    // for mkdir
     {
         int argTypes[4];
 
         argTypes[0] =
             (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
 
-        argTypes[1] = (1u << ARG_INPUT) |  (ARG_INT << 16u);
+        argTypes[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
 
         argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
 
         argTypes[3] = 0;
 
         // We need to register the function with the types and the name.
-        ret = rpcRegister((char *) "lock", argTypes, watdfs_lock);
+        ret = rpcRegister((char *) "mkdir", argTypes, watdfs_mkdir);
+        if (ret < 0) {
+            DLOG("mkdir failed");
+            return ret;
+        }
+        DLOG("mkdir succeeded");
+    }
+
+    // for unlink
+    {
+        int argTypes[3];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[2] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "unlink", argTypes, watdfs_unlink);
+        if (ret < 0) {
+            DLOG("unlink failed");
+            return ret;
+        }
+        DLOG("unlink succeeded");
+    }
+
+    // for rmdir
+    {
+        int argTypes[3];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[2] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "rmdir", argTypes, watdfs_rmdir);
         if (ret < 0) {
-            DLOG("lock failed");
+            DLOG("rmdir failed");
             return ret;
         }
-        DLOG("lock succeeded");
+        DLOG("rmdir succeeded");
     }
 
-    // for unlock
+    // for rename
     {
         int argTypes[4];
 
         argTypes[0] =
             (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
 
-        argTypes[1] = (1u << ARG_INPUT) |  (ARG_INT << 16u);
+        argTypes[1] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
 
         argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
 
         argTypes[3] = 0;
 
         // We need to register the function with the types and the name.
-        ret = rpcRegister((char *) "unlock", argTypes, watdfs_unlock);
+        ret = rpcRegister((char *) "rename", argTypes, watdfs_rename);
+        if (ret < 0) {
+            DLOG("rename failed");
+            return ret;
+        }
+        DLOG("rename succeeded");
+    }
+
+    // for readdir
+    {
+        int argTypes[6];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[3] = (1u << ARG_OUTPUT) | (ARG_LONG << 16u);
+
+        argTypes[4] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[5] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "readdir", argTypes, watdfs_readdir);
+        if (ret < 0) {
+            DLOG("readdir failed");
+            return ret;
+        }
+        DLOG("readdir succeeded");
+    }
+
+    // for openfetch
+    {
+        int argTypes[8];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[3] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[4] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[5] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[6] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[7] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "openfetch", argTypes, watdfs_openfetch);
+        if (ret < 0) {
+            DLOG("openfetch failed");
+            return ret;
+        }
+        DLOG("openfetch succeeded");
+    }
+
+    // for getattr_multi
+    {
+        int argTypes[5];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+
+        argTypes[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[3] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[4] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "getattr_multi", argTypes, watdfs_getattr_multi);
+        if (ret < 0) {
+            DLOG("getattr_multi failed");
+            return ret;
+        }
+        DLOG("getattr_multi succeeded");
+    }
+
+    // for lease
+    {
+        int argTypes[6];
+
+        argTypes[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[1] = (1u << ARG_INPUT) | (ARG_INT << 16u);
+
+        argTypes[2] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+
+        argTypes[3] = (1u << ARG_INPUT) | (ARG_LONG << 16u);
+
+        argTypes[4] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
+
+        argTypes[5] = 0;
+
+        // We need to register the function with the types and the name.
+        ret = rpcRegister((char *) "lease", argTypes, watdfs_lease);
         if (ret < 0) {
-            DLOG("unlock failed");
+            DLOG("lease failed");
             return ret;
         }
-        DLOG("unlock succeeded");
+        DLOG("lease succeeded");
     }
 
     // Hand over control to the RPC library by calling `rpcExecute`.
@@ -0,0 +1,169 @@
+#include "writeback.h"
+#include "attr_cache.h"
+#include "rpc_calls.h"
+#include "utils.h"
+#include "debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+using namespace std;
+
+// Push what was written to one open file since its last upload. Only taking
+// the file's dirty ranges and the bookkeeping afterwards hold store_mutex, so
+// writes to the file carry on while its data is on the wire.
+static int flush_open_file(struct files_store *user, const string &full_path) {
+    string path = full_path.substr(strlen(user->path_to_cache));
+    map<off_t, off_t> dirty;
+    off_t truncated_to = -1;
+    int fh = 0;
+    struct fuse_file_info fi;
+    fi.flags = O_RDWR;
+
+    {
+        lock_guard<mutex> guard(user->store_mutex);
+        auto it = user->cur_open_files.find(full_path);
+        if (it == user->cur_open_files.end()) {
+            return 0;
+        }
+
+        struct file_info &file = it->second;
+        dirty.swap(file.dirty);
+        truncated_to = file.truncated_to;
+        file.truncated_to = -1;
+        fh = file.client_fi;
+        fi.fh = file.server_fi;
+
+        invalidate_server_attr(user, path.c_str());
+    }
+
+    int fxn_ret = 0;
+
+    struct stat local;
+    if (fstat(fh, &local) < 0) {
+        DLOG("Flush: Could not get file metadata at client");
+        fxn_ret = -errno;
+    }
+
+    // write lock only the ranges this flush changes at the server
+    map<off_t, off_t> locked;
+    if (fxn_ret == 0) {
+        off_t tail = local.st_size;
+        if (truncated_to >= 0 && truncated_to < tail) {
+            tail = truncated_to;
+        }
+        locked = upload_lock_ranges(dirty, tail);
+        fxn_ret = lock_ranges(user, path.c_str(), locked, RW_WRITE_LOCK);
+        if (fxn_ret < 0) {
+            locked.clear();
+        }
+    }
+
+    // cut the server copy down first if the file was shrunk
+    if (fxn_ret == 0 && truncated_to >= 0 && truncated_to < local.st_size) {
+        fxn_ret = rpc_truncate(user, path.c_str(), truncated_to);
+    }
+
+    if (fxn_ret == 0) {
+        fxn_ret = rpc_truncate(user, path.c_str(), local.st_size);
+    }
+
+    for (auto it = dirty.begin(); it != dirty.end() && fxn_ret == 0; it++) {
+        off_t end = min(it->second, local.st_size);
+        if (it->first < end) {
+            fxn_ret = push_range_to_server(user, path.c_str(), fh, it->first, end - it->first, &fi);
+        }
+    }
+
+    // T_server follows T_client
+    if (fxn_ret == 0) {
+        struct timespec ts[2];
+        ts[0] = local.st_mtim;
+        ts[1] = local.st_mtim;
+        fxn_ret = rpc_utimensat(user, path.c_str(), ts);
+    }
+
+    // release lock, a range reaped mid flush means the flush is retried
+    int unlocked = unlock_ranges(user, path.c_str(), locked, RW_WRITE_LOCK);
+    if (unlocked < 0 && fxn_ret == 0) {
+        fxn_ret = unlocked;
+    }
+
+    lock_guard<mutex> guard(user->store_mutex);
+    auto it = user->cur_open_files.find(full_path);
+    if (it == user->cur_open_files.end()) {
+        return fxn_ret;
+    }
+
+    struct file_info &file = it->second;
+    if (fxn_ret < 0) {
+        // keep the ranges so the next flush retries them
+        DLOG("Flush: Could not push '%s' to server", path.c_str());
+        for (auto range = dirty.begin(); range != dirty.end(); range++) {
+            mark_dirty(&file, range->first, range->second - range->first);
+        }
+        if (truncated_to >= 0 && (file.truncated_to < 0 || truncated_to < file.truncated_to)) {
+            file.truncated_to = truncated_to;
+        }
+    }
+    else {
+        file.tc = time(0);
+        // the server's version is learned at the next freshness check
+        file.version_known = false;
+    }
+
+    // getattr may have seen the server mid flush
+    invalidate_server_attr(user, path.c_str());
+    return fxn_ret;
+}
+
+// Called with flush_mutex held, so release and fsync wait for a pass in
+// progress before closing or uploading a file themselves.
+static void flush_open_files(struct files_store *user) {
+    vector<string> pending;
+    {
+        lock_guard<mutex> guard(user->store_mutex);
+        for (auto it = user->cur_open_files.begin(); it != user->cur_open_files.end(); it++) {
+            const struct file_info &file = it->second;
+            if (get_access_mode(file.flags) != O_RDONLY && !file.stream &&
+                (!file.dirty.empty() || file.truncated_to >= 0)) {
+                pending.push_back(it->first);
+            }
+        }
+    }
+
+    for (auto it = pending.begin(); it != pending.end(); it++) {
+        flush_open_file(user, *it);
+    }
+}
+
+static void flusher_loop(struct files_store *user, time_t interval) {
+    unique_lock<mutex> flushing(user->flush_mutex);
+
+    while (!user->flusher_stopping) {
+        user->flush_cv.wait_for(flushing, chrono::seconds(interval));
+        if (!user->flusher_stopping) {
+            flush_open_files(user);
+        }
+    }
+}
+
+void writeback_start(struct files_store *user, time_t interval) {
+    user->flusher = thread(flusher_loop, user, max(interval, (time_t) 1));
+}
+
+void writeback_stop(struct files_store *user) {
+    if (!user->flusher.joinable()) {
+        return;
+    }
+
+    {
+        lock_guard<mutex> flushing(user->flush_mutex);
+        user->flusher_stopping = true;
+    }
+    user->flush_cv.notify_all();
+    user->flusher.join();
+}
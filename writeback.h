@@ -0,0 +1,17 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <time.h>
+#include "global.h"
+
+// In write-back mode (WATDFS_WRITE_BACK) writes only go to the local copy.
+// A flusher thread pushes the dirty ranges of open files to the server every
+// flush interval; fsync and release still push synchronously.
+
+// Start the flusher, running a pass every interval seconds.
+void writeback_start(struct files_store *user, time_t interval);
+
+// Stop the flusher, waiting for a pass in progress to finish.
+void writeback_stop(struct files_store *user);
+
+#endif